@@ -0,0 +1,159 @@
+/**
+ * WISE_Processing_Lib: kmlbench.cpp
+ * Copyright (C) 2023  WISE
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "kmlinternal.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+using namespace KML::Internal;
+using namespace KML::Internal::Input;
+using namespace KML::Internal::Output;
+
+
+//placemarks with times a few minutes apart, the way a fire growth simulation writes them
+static std::vector<InputPlacemark*> makePlacemarks(std::size_t count)
+{
+	std::vector<InputPlacemark*> placemarks;
+	placemarks.reserve(count);
+	const std::int64_t start = 1622574000;
+	kml_char buffer[19];
+	for (std::size_t i = 0; i < count; i++)
+	{
+		formatDateTime(start + static_cast<std::int64_t>(i) * 300, buffer);
+		auto placemark = new InputPlacemark();
+		placemark->time.assign(buffer, 19);
+		placemark->time.append(_K("-06:00"));
+		placemarks.push_back(placemark);
+	}
+	return placemarks;
+}
+
+template<typename Function>
+static double measure(const char* name, std::size_t count, Function function)
+{
+	auto start = std::chrono::steady_clock::now();
+	std::size_t check = function();
+	std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+	double perTime = elapsed.count() / count;
+	std::printf("%-28s %10.1f ns per time (%zu)\n", name, perTime, check);
+	return perTime;
+}
+
+//the memory held by the input and output models of a KML or KMZ file, the coordinate text dominates both
+static int measureModels(const char* path, bool streaming)
+{
+	int result = 0;
+	initializeXML();
+	try
+	{
+		InputKmlFile file(path, streaming);
+		if (file.document)
+		{
+			ModelArena outputArena(file.arena());
+			OutputDocument* output;
+			{
+				ModelArena::Scope scope(&outputArena);
+				output = new OutputDocument(file.document);
+			}
+			std::printf("%-28s %10.1f MB input, %.1f MB output (%s)\n",
+#ifdef KML_UTF8_MODEL
+				"UTF-8 model",
+#else
+				"UTF-16 model",
+#endif
+				file.arena()->reserved() / 1048576.0, outputArena.reserved() / 1048576.0, path);
+			delete output;
+		}
+		else
+		{
+			std::printf("%s is not a KML file\n", path);
+			result = 1;
+		}
+	}
+	catch (std::exception& e)
+	{
+		std::printf("%s could not be read: %s\n", path, e.what());
+		result = 1;
+	}
+	deinitializeXML();
+	return result;
+}
+
+//kmlbench [count] times the placemark time conversion
+//kmlbench --model [--streaming] file measures the models read from a file, build with and without
+//KML_UTF8_MODEL to compare the two
+int main(int argc, char* argv[])
+{
+	if (argc > 1 && std::strcmp(argv[1], "--model") == 0)
+	{
+		bool streaming = argc > 2 && std::strcmp(argv[2], "--streaming") == 0;
+		if (argc != (streaming ? 4 : 3))
+		{
+			std::printf("usage: kmlbench --model [--streaming] file\n");
+			return 1;
+		}
+		return measureModels(argv[argc - 1], streaming);
+	}
+
+	std::size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000;
+	const HSS_Time::WTimeSpan offset(-6 * 60 * 60);
+	ModelArena arena;
+	std::vector<InputPlacemark*> placemarks;
+	{
+		ModelArena::Scope scope(&arena);
+		placemarks = makePlacemarks(count);
+	}
+
+	//both paths start from a new context and end with the text of the time in the offset, the way
+	//OutputFolder::applyOffset uses them
+	double wtime = measure("WTime parse and format", count, [&]() {
+		OutputTimeContext context(offset);
+		std::size_t length = 0;
+		for (auto placemark : placemarks)
+		{
+			HSS_Time::WTime time(&context.manager);
+			if (context.parse(placemark, time))
+				length += context.format(time).length();
+		}
+		return length;
+	});
+
+	double fast = measure("Fast path parse and format", count, [&]() {
+		OutputTimeContext context(offset);
+		std::size_t length = 0;
+		for (auto placemark : placemarks)
+		{
+			std::int64_t seconds;
+			bool hasTime;
+			if (context.parseSeconds(placemark, seconds, hasTime))
+				length += context.formatSeconds(seconds).length();
+		}
+		return length;
+	});
+
+	for (auto placemark : placemarks)
+		delete placemark;
+
+	std::printf("speedup %.1fx\n", wtime / fast);
+	return 0;
+}
@@ -21,14 +21,42 @@
 #include "WTime.h"
 
 #include <cctype>
-#include <codecvt>
+#include <charconv>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <limits>
+#include <memory>
 #include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <errno.h>
+#include <locale.h>
 #include <minizip/unzip.h>
 #include <minizip/zip.h>
 
 #include <boost/algorithm/string.hpp>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KML_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 using namespace KML::Internal;
 using namespace KML::Internal::Input;
 using namespace KML::Internal::Output;
@@ -44,74 +72,722 @@ bool iequals(const xerces_string &str1, const xerces_string &str2)
 	});
 }
 
+bool iequals(kml_string_view str1, const kml_char* str2)
+{
+	std::size_t i = 0;
+	for (; i < str1.size() && str2[i]; i++)
+	{
+		auto c1 = static_cast<std::make_unsigned_t<kml_char>>(str1[i]);
+		auto c2 = static_cast<std::make_unsigned_t<kml_char>>(str2[i]);
+		if (c1 != c2 && std::toupper(c1) != std::toupper(c2))
+			return false;
+	}
+	return i == str1.size() && !str2[i];
+}
+
 
-#ifdef _MSC_VER
-#define _CHAR_ int16_t
-#else
-#define _CHAR_ xerces_char
+template<typename String>
+static String transcodeToUtf8(const xerces_char* in, std::size_t length)
+{
+	String result;
+	//most of the strings in a KML file are ASCII so this is usually the final size
+	result.resize(length);
+	const xerces_char* end = in + length;
+	std::size_t out = 0;
+
+	while (in < end)
+	{
+#ifdef KML_USE_SSE2
+		if constexpr (sizeof(xerces_char) == 2)
+		{
+			//convert 8 characters at a time while they are all ASCII
+			const __m128i mask = _mm_set1_epi16(static_cast<short>(0xff80));
+			while (end - in >= 8)
+			{
+				__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+				if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(chunk, mask), _mm_setzero_si128())) != 0xffff)
+					break;
+				if (result.size() < out + 8)
+					result.resize(result.size() + (end - in) + 8);
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(&result[out]), _mm_packus_epi16(chunk, chunk));
+				in += 8;
+				out += 8;
+			}
+			if (in == end)
+				break;
+		}
 #endif
 
+		std::uint32_t c = static_cast<std::uint32_t>(*in++);
+		if (c >= 0xd800 && c <= 0xdfff)
+		{
+			//a high surrogate has to be followed by a low surrogate
+			if (c > 0xdbff || in == end || static_cast<std::uint32_t>(*in) < 0xdc00 || static_cast<std::uint32_t>(*in) > 0xdfff)
+				throw std::range_error("invalid UTF-16 string");
+			c = 0x10000 + ((c - 0xd800) << 10) + (static_cast<std::uint32_t>(*in++) - 0xdc00);
+		}
+		else if (c > 0x10ffff)
+			throw std::range_error("invalid UTF-16 string");
+
+		if (result.size() < out + 4)
+			result.resize(result.size() + (end - in) + 4);
+		if (c < 0x80)
+			result[out++] = static_cast<char>(c);
+		else if (c < 0x800)
+		{
+			result[out++] = static_cast<char>(0xc0 | (c >> 6));
+			result[out++] = static_cast<char>(0x80 | (c & 0x3f));
+		}
+		else if (c < 0x10000)
+		{
+			result[out++] = static_cast<char>(0xe0 | (c >> 12));
+			result[out++] = static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+			result[out++] = static_cast<char>(0x80 | (c & 0x3f));
+		}
+		else
+		{
+			result[out++] = static_cast<char>(0xf0 | (c >> 18));
+			result[out++] = static_cast<char>(0x80 | ((c >> 12) & 0x3f));
+			result[out++] = static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+			result[out++] = static_cast<char>(0x80 | (c & 0x3f));
+		}
+	}
+
+	result.resize(out);
+	return result;
+}
 
 std::string KML::Internal::utf16_to_utf8(const xerces_string &utf16_string)
 {
-    std::wstring_convert<std::codecvt_utf8_utf16<_CHAR_>, _CHAR_> convert;
-    auto p = reinterpret_cast<const _CHAR_ *>(utf16_string.data());
-    return convert.to_bytes(p, p + utf16_string.size());
+	return transcodeToUtf8<std::string>(utf16_string.data(), utf16_string.size());
 }
 
-xerces_string KML::Internal::utf8_to_utf16(const std::string &utf8_string)
+template<typename String>
+static String transcodeToUtf16(const char* text, std::size_t length)
 {
-#ifdef XERCES_USE_U
-	std::wstring_convert<std::codecvt_utf8_utf16<_CHAR_>, _CHAR_> convert;
-	auto p = convert.from_bytes(utf8_string);
-	xerces_string utf16_string(reinterpret_cast<const xerces_char *>(p.data()));
-	return utf16_string;
-#else
-	std::wstring_convert<std::codecvt_utf8_utf16<xerces_char>> convert;
-	return convert.from_bytes(utf8_string);
+	//the UTF-16 string is never longer than the UTF-8 string
+	String result(length, 0);
+	auto in = reinterpret_cast<const std::uint8_t*>(text);
+	auto end = in + length;
+	std::size_t out = 0;
+
+	while (in < end)
+	{
+#ifdef KML_USE_SSE2
+		if constexpr (sizeof(xerces_char) == 2)
+		{
+			//convert 16 characters at a time while they are all ASCII
+			while (end - in >= 16)
+			{
+				__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+				if (_mm_movemask_epi8(chunk) != 0)
+					break;
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(&result[out]), _mm_unpacklo_epi8(chunk, _mm_setzero_si128()));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(&result[out + 8]), _mm_unpackhi_epi8(chunk, _mm_setzero_si128()));
+				in += 16;
+				out += 16;
+			}
+			if (in == end)
+				break;
+		}
 #endif
+
+		std::uint32_t c = *in++;
+		if (c >= 0x80)
+		{
+			std::size_t extra;
+			std::uint32_t minimum;
+			if ((c & 0xe0) == 0xc0)
+			{
+				extra = 1;
+				minimum = 0x80;
+				c &= 0x1f;
+			}
+			else if ((c & 0xf0) == 0xe0)
+			{
+				extra = 2;
+				minimum = 0x800;
+				c &= 0x0f;
+			}
+			else if ((c & 0xf8) == 0xf0)
+			{
+				extra = 3;
+				minimum = 0x10000;
+				c &= 0x07;
+			}
+			else
+				throw std::range_error("invalid UTF-8 string");
+			if (static_cast<std::size_t>(end - in) < extra)
+				throw std::range_error("invalid UTF-8 string");
+			for (std::size_t i = 0; i < extra; i++)
+			{
+				if ((in[i] & 0xc0) != 0x80)
+					throw std::range_error("invalid UTF-8 string");
+				c = (c << 6) | (in[i] & 0x3f);
+			}
+			in += extra;
+			//reject overlong encodings, surrogates, and anything past the end of unicode
+			if (c < minimum || (c >= 0xd800 && c <= 0xdfff) || c > 0x10ffff)
+				throw std::range_error("invalid UTF-8 string");
+
+			if (c >= 0x10000)
+			{
+				c -= 0x10000;
+				result[out++] = static_cast<xerces_char>(0xd800 + (c >> 10));
+				c = 0xdc00 + (c & 0x3ff);
+			}
+		}
+		result[out++] = static_cast<xerces_char>(c);
+	}
+
+	result.resize(out);
+	return result;
+}
+
+xerces_string KML::Internal::utf8_to_utf16(const std::string &utf8_string)
+{
+	return transcodeToUtf16<xerces_string>(utf8_string.data(), utf8_string.size());
 }
 
 
-int KML::Internal::stoi(const xerces_string& _Str, size_t *_Idx, int _Base) {	// convert wstring to double
-	std::string str = utf16_to_utf8(_Str);
-	const char *_Ptr = str.c_str();
-	char *_Eptr;
+//copies the leading ASCII of a string for the number parsers, they stop at the first non-ASCII character anyway
+class NumberBuffer
+{
+public:
+	NumberBuffer(const kml_string& str)
+	{
+		std::size_t length = 0;
+		while (length < str.size() && static_cast<std::uint32_t>(str[length]) < 0x80)
+			length++;
+		//numbers are short, only long strings need to go on the heap
+		if (length >= sizeof(m_local))
+		{
+			m_heap.reset(new char[length + 1]);
+			m_text = m_heap.get();
+		}
+		else
+			m_text = m_local;
+		for (std::size_t i = 0; i < length; i++)
+			m_text[i] = static_cast<char>(str[i]);
+		m_text[length] = '\0';
+		m_length = length;
+	}
+
+	const char* begin() const { return m_text; }
+	const char* end() const { return m_text + m_length; }
+
+private:
+	char m_local[64];
+	std::unique_ptr<char[]> m_heap;
+	char* m_text;
+	std::size_t m_length;
+};
+
+//skip what strtol and strtod allow before a number, leading whitespace and a plus sign
+static const char* skipNumberPrefix(const char* p, const char* end)
+{
+	while (p < end && std::isspace(static_cast<unsigned char>(*p)))
+		p++;
+	if (p < end && *p == '+' && (p + 1 == end || (p[1] != '-' && p[1] != '+')))
+		p++;
+	return p;
+}
+
+//the way the "C" locale reads it whatever the process locale is, returns begin if there isn't a number
+static const char* readDouble(const char* begin, const char* end, double& value, bool& outOfRange)
+{
+	outOfRange = false;
+	const char* p = begin;
+	if (p < end && *p == '+' && (p + 1 == end || (p[1] != '-' && p[1] != '+')))
+		p++;
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+	auto result = std::from_chars(p, end, value);
+	if (result.ec == std::errc::invalid_argument)
+		return begin;
+	outOfRange = result.ec == std::errc::result_out_of_range;
+	return result.ptr;
+#else
+	std::string text(p, end);
+	char* last;
+	errno = 0;
 #ifdef _MSC_VER
-	_set_errno(0);
+	static const _locale_t locale = _create_locale(LC_NUMERIC, "C");
+	value = _strtod_l(text.c_str(), &last, locale);
+#else
+	static const locale_t locale = newlocale(LC_NUMERIC_MASK, "C", nullptr);
+	value = strtod_l(text.c_str(), &last, locale);
+#endif
+	if (last == text.c_str())
+		return begin;
+	outOfRange = errno == ERANGE;
+	return p + (last - text.c_str());
 #endif
-	long _Ans = strtol(_Ptr, &_Eptr, _Base);
+}
+
 
-	if (_Ptr == _Eptr)
+int KML::Internal::stoi(const kml_string& _Str, size_t *_Idx, int _Base) {	// convert wstring to int
+	NumberBuffer str(_Str);
+	const char* p = skipNumberPrefix(str.begin(), str.end());
+	if (_Base == 16 && str.end() - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+		p += 2;
+
+	//from_chars never depends on the locale
+	int value = 0;
+	auto result = std::from_chars(p, str.end(), value, _Base);
+	if (result.ec == std::errc::invalid_argument)
 		throw std::invalid_argument("invalid stoi argument");
-#ifdef _MSC_VER
-	if ((*_errno()) == ERANGE || _Ans < INT_MIN || INT_MAX < _Ans)
+	if (result.ec == std::errc::result_out_of_range)
 		throw std::out_of_range("stoi argument out of range");
-#endif
 	if (_Idx != 0)
-		*_Idx = (size_t)(_Eptr - _Ptr);
-	return ((int)_Ans);
+		*_Idx = (size_t)(result.ptr - str.begin());
+	return value;
 }
 
 
-double KML::Internal::stod(const xerces_string& _Str, size_t *_Idx) {	// convert wstring to double
-	std::string str = utf16_to_utf8(_Str);
-	const char *_Ptr = str.c_str();
-	char *_Eptr;
-#ifdef _MSC_VER
-	_set_errno(0);
-#endif
-	double _Ans = strtod(_Ptr, &_Eptr);
+double KML::Internal::stod(const kml_string& _Str, size_t *_Idx) {	// convert wstring to double
+	NumberBuffer str(_Str);
+	const char* p = skipNumberPrefix(str.begin(), str.end());
+	//a plus sign is handled by readDouble so it can be used on its own
+	if (p > str.begin() && p[-1] == '+')
+		p--;
 
-	if (_Ptr == _Eptr)
+	double value = 0;
+	bool outOfRange;
+	const char* last = readDouble(p, str.end(), value, outOfRange);
+	if (last == p)
 		throw std::invalid_argument("invalid stod argument");
-#ifdef _MSC_VER
-	if ((*_errno()) == ERANGE)
+	if (outOfRange)
 		throw std::out_of_range("stod argument out of range");
-#endif
 	if (_Idx != 0)
-		*_Idx = (size_t)(_Eptr - _Ptr);
-	return (_Ans);
+		*_Idx = (size_t)(last - str.begin());
+	return value;
+}
+
+
+kml_string KML::Internal::xerces_to_kml(const XMLCh* text)
+{
+	if (!text)
+		return kml_string();
+#ifdef KML_UTF8_MODEL
+	return transcodeToUtf8<kml_string>(reinterpret_cast<const xerces_char*>(text), XMLString::stringLen(text));
+#else
+	return kml_string(reinterpret_cast<const xerces_char*>(text));
+#endif
+}
+
+kml_string KML::Internal::xerces_to_kml(const xerces_string& text)
+{
+#ifdef KML_UTF8_MODEL
+	return transcodeToUtf8<kml_string>(text.data(), text.size());
+#else
+	return kml_string(text.data(), text.size());
+#endif
+}
+
+KML::Internal::XercesTextView::XercesTextView(const XMLCh* text)
+{
+	if (text)
+	{
+#ifdef KML_UTF8_MODEL
+		m_text = transcodeToUtf8<std::string>(reinterpret_cast<const xerces_char*>(text), XMLString::stringLen(text));
+		m_view = m_text;
+#else
+		m_view = kml_string_view(reinterpret_cast<const xerces_char*>(text));
+#endif
+	}
+}
+
+KML::Internal::XercesTextView::XercesTextView(const xerces_string& text)
+{
+#ifdef KML_UTF8_MODEL
+	m_text = transcodeToUtf8<std::string>(text.data(), text.size());
+	m_view = m_text;
+#else
+	m_view = kml_string_view(text.data(), text.size());
+#endif
+}
+
+xerces_string KML::Internal::kml_to_xerces(const kml_string& text)
+{
+#ifdef KML_UTF8_MODEL
+	return transcodeToUtf16<xerces_string>(text.data(), text.size());
+#else
+	return xerces_string(text.data(), text.size());
+#endif
+}
+
+std::string KML::Internal::kml_to_utf8(const kml_string& text)
+{
+#ifdef KML_UTF8_MODEL
+	return std::string(text.data(), text.size());
+#else
+	return transcodeToUtf8<std::string>(text.data(), text.size());
+#endif
+}
+
+kml_string KML::Internal::utf8_to_kml(const std::string& text)
+{
+#ifdef KML_UTF8_MODEL
+	return kml_string(text.data(), text.size());
+#else
+	return transcodeToUtf16<kml_string>(text.data(), text.size());
+#endif
+}
+
+
+//later blocks double in size up to the maximum
+static constexpr std::size_t ARENA_BLOCK_SIZE = 64 * 1024;
+static constexpr std::size_t ARENA_MAX_BLOCK_SIZE = 4 * 1024 * 1024;
+
+static thread_local ModelArena* s_currentArena = nullptr;
+
+KML::Internal::ModelArena::ModelArena(ModelArena* strings)
+	: m_block(nullptr),
+	  m_next(nullptr),
+	  m_end(nullptr),
+	  m_blockSize(ARENA_BLOCK_SIZE),
+	  m_reserved(0),
+	  m_strings(nullptr),
+	  m_ownsStrings(!strings)
+{
+	if (strings)
+		m_strings = strings->m_strings;
+	else
+	{
+		Scope scope(this);
+		m_strings = new StringTable();
+	}
+}
+
+KML::Internal::ModelArena::~ModelArena()
+{
+	//the table's containers are in the blocks so it goes first
+	if (m_ownsStrings)
+		delete m_strings;
+	while (m_block)
+	{
+		auto previous = m_block->previous;
+		::operator delete(m_block);
+		m_block = previous;
+	}
+}
+
+void* KML::Internal::ModelArena::allocate(std::size_t size, std::size_t alignment)
+{
+	auto aligned = (reinterpret_cast<std::uintptr_t>(m_next) + alignment - 1) & ~static_cast<std::uintptr_t>(alignment - 1);
+	if (!m_block || aligned + size > reinterpret_cast<std::uintptr_t>(m_end))
+	{
+		//whatever is left in the current block is abandoned, large allocations get a block of their own
+		std::size_t blockSize = std::max(m_blockSize, sizeof(Block) + size + alignment);
+		auto block = static_cast<Block*>(::operator new(blockSize));
+		block->previous = m_block;
+		m_block = block;
+		m_next = reinterpret_cast<char*>(block + 1);
+		m_end = reinterpret_cast<char*>(block) + blockSize;
+		m_reserved += blockSize;
+		if (m_blockSize < ARENA_MAX_BLOCK_SIZE)
+			m_blockSize *= 2;
+		aligned = (reinterpret_cast<std::uintptr_t>(m_next) + alignment - 1) & ~static_cast<std::uintptr_t>(alignment - 1);
+	}
+
+	m_next = reinterpret_cast<char*>(aligned + size);
+	return reinterpret_cast<void*>(aligned);
+}
+
+ModelArena* KML::Internal::ModelArena::current()
+{
+	return s_currentArena;
+}
+
+StringTable& KML::Internal::ModelArena::strings()
+{
+	return *m_strings;
+}
+
+KML::Internal::ModelArena::Scope::Scope(ModelArena* arena)
+	: m_previous(s_currentArena)
+{
+	s_currentArena = arena;
+}
+
+KML::Internal::ModelArena::Scope::~Scope()
+{
+	s_currentArena = m_previous;
+}
+
+//every object is prefixed with its arena so deleting it knows where it came from
+static constexpr std::size_t ARENA_OBJECT_HEADER = alignof(std::max_align_t);
+
+void* KML::Internal::ArenaObject::operator new(std::size_t size)
+{
+	auto arena = s_currentArena;
+	char* p;
+	if (arena)
+		p = static_cast<char*>(arena->allocate(size + ARENA_OBJECT_HEADER, alignof(std::max_align_t)));
+	else
+		p = static_cast<char*>(::operator new(size + ARENA_OBJECT_HEADER));
+	*reinterpret_cast<ModelArena**>(p) = arena;
+	return p + ARENA_OBJECT_HEADER;
+}
+
+void KML::Internal::ArenaObject::operator delete(void* p)
+{
+	if (p)
+	{
+		auto base = static_cast<char*>(p) - ARENA_OBJECT_HEADER;
+		if (!*reinterpret_cast<ModelArena**>(base))
+			::operator delete(base);
+	}
+}
+
+
+const kml_string& KML::Internal::InternedString::emptyString()
+{
+	//shared by every table so it mustn't belong to any arena
+	static const kml_string empty = []() { ModelArena::Scope heap(nullptr); return kml_string(); }();
+	return empty;
+}
+
+KML::Internal::StringTable::StringTable()
+{
+}
+
+InternedString KML::Internal::StringTable::intern(kml_string_view text)
+{
+	if (text.empty())
+		return InternedString();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto found = m_lookup.find(text);
+	if (found != m_lookup.end())
+		return InternedString(found->second);
+
+	//the deque never moves its strings so the lookup can reference them
+	m_storage.emplace_back(text.data(), text.length(), ArenaAllocator<kml_char>(m_storage.get_allocator()));
+	auto& stored = m_storage.back();
+	m_lookup.emplace(kml_string_view(stored), &stored);
+	return InternedString(&stored);
+}
+
+InternedString KML::Internal::intern(kml_string_view text)
+{
+	//a table on the heap would have nothing to release it
+	if (auto arena = ModelArena::current())
+		return arena->strings().intern(text);
+	throw std::logic_error("strings can only be interned in a model arena");
+}
+
+
+//larger blocks go to the heap
+static constexpr std::size_t POOL_GRANULARITY = 16;
+static constexpr std::size_t POOL_CLASSES = 64;
+//every block is prefixed with its size class
+static constexpr std::size_t POOL_HEADER = alignof(std::max_align_t);
+
+//a memory manager for one parse or serialisation, small blocks are recycled through per size free lists and everything is released when it is destroyed
+class PoolMemoryManager : public xercesc::MemoryManager
+{
+public:
+	PoolMemoryManager()
+	{
+		std::fill(std::begin(m_free), std::end(m_free), nullptr);
+	}
+
+	PoolMemoryManager(const PoolMemoryManager&) = delete;
+	PoolMemoryManager& operator=(const PoolMemoryManager&) = delete;
+
+	xercesc::MemoryManager* getExceptionMemoryManager() override
+	{
+		//exceptions can outlive the parse
+		return XMLPlatformUtils::fgMemoryManager;
+	}
+
+	void* allocate(XMLSize_t size) override
+	{
+		std::size_t sizeClass = (size + POOL_GRANULARITY - 1) / POOL_GRANULARITY;
+		char* p;
+		if (sizeClass >= POOL_CLASSES)
+		{
+			p = static_cast<char*>(::operator new(size + POOL_HEADER));
+			sizeClass = POOL_CLASSES;
+		}
+		else if (m_free[sizeClass])
+		{
+			p = m_free[sizeClass];
+			m_free[sizeClass] = *reinterpret_cast<char**>(p);
+		}
+		else
+			p = static_cast<char*>(m_arena.allocate(POOL_HEADER + sizeClass * POOL_GRANULARITY, alignof(std::max_align_t)));
+
+		*reinterpret_cast<std::size_t*>(p) = sizeClass;
+		return p + POOL_HEADER;
+	}
+
+	void deallocate(void* p) override
+	{
+		if (!p)
+			return;
+
+		auto base = static_cast<char*>(p) - POOL_HEADER;
+		auto sizeClass = *reinterpret_cast<std::size_t*>(base);
+		if (sizeClass == POOL_CLASSES)
+			::operator delete(base);
+		else
+		{
+			*reinterpret_cast<char**>(base) = m_free[sizeClass];
+			m_free[sizeClass] = base;
+		}
+	}
+
+private:
+	ModelArena m_arena;
+	char* m_free[POOL_CLASSES];
+};
+
+//releases a Xerces DOM object when it goes out of scope, blocks larger than a pool's size classes are only freed that way
+struct XercesRelease
+{
+	template<typename T>
+	void operator()(T* p) const
+	{
+		p->release();
+	}
+};
+
+template<typename T>
+using XercesPtr = std::unique_ptr<T, XercesRelease>;
+
+
+template<typename CharT>
+static inline bool isSpace(CharT c)
+{
+	return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static inline bool readDigits(const kml_char* text, std::size_t count, std::int32_t& value)
+{
+	value = 0;
+	for (std::size_t i = 0; i < count; i++)
+	{
+		std::uint32_t digit = static_cast<std::uint32_t>(text[i]) - '0';
+		if (digit > 9)
+			return false;
+		value = value * 10 + static_cast<std::int32_t>(digit);
+	}
+	return true;
+}
+
+//days from 1970-01-01 in the proleptic Gregorian calendar
+static inline std::int64_t daysFromCivil(std::int32_t year, std::int32_t month, std::int32_t day)
+{
+	year -= month <= 2;
+	const std::int64_t era = (year >= 0 ? year : year - 399) / 400;
+	const std::int64_t yoe = year - era * 400;
+	const std::int64_t doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	const std::int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+//YYYY-MM-DD?HH:MM:SS as seconds since 1970, separator is the character between the date and time
+static bool readDateTime(const kml_char* text, kml_char separator, std::int64_t& seconds)
+{
+	std::int32_t year, month, day, hour, minute, second;
+	if (!readDigits(text, 4, year) || text[4] != '-' || !readDigits(text + 5, 2, month) || text[7] != '-' ||
+		!readDigits(text + 8, 2, day) || text[10] != separator || !readDigits(text + 11, 2, hour) || text[13] != ':' ||
+		!readDigits(text + 14, 2, minute) || text[16] != ':' || !readDigits(text + 17, 2, second))
+		return false;
+
+	static constexpr std::int32_t monthDays[] = { 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+	//leap seconds and anything else unusual is left to WTime
+	if (month < 1 || month > 12 || day < 1 || day > monthDays[month - 1] || hour > 23 || minute > 59 || second > 59)
+		return false;
+	if (month == 2 && day == 29 && !((year % 4 == 0 && year % 100 != 0) || year % 400 == 0))
+		return false;
+
+	seconds = daysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+	return true;
+}
+
+bool KML::Internal::parseIso8601(const kml_char* text, std::size_t length, std::int64_t& seconds)
+{
+	if (length < 20 || !readDateTime(text, 'T', seconds))
+		return false;
+
+	const kml_char* zone = text + 19;
+	std::size_t zoneLength = length - 19;
+	if (zoneLength == 1 && (zone[0] == 'Z' || zone[0] == 'z'))
+		return true;
+	if (zone[0] != '+' && zone[0] != '-')
+		return false;
+
+	//+HH, +HHMM, or +HH:MM
+	std::int32_t hours, minutes = 0;
+	if (zoneLength < 3 || !readDigits(zone + 1, 2, hours))
+		return false;
+	if (zoneLength == 5)
+	{
+		if (!readDigits(zone + 3, 2, minutes))
+			return false;
+	}
+	else if (zoneLength == 6)
+	{
+		if (zone[3] != ':' || !readDigits(zone + 4, 2, minutes))
+			return false;
+	}
+	else if (zoneLength != 3)
+		return false;
+	if (hours > 23 || minutes > 59)
+		return false;
+
+	std::int64_t offset = hours * 3600 + minutes * 60;
+	seconds -= zone[0] == '+' ? offset : -offset;
+	return true;
+}
+
+bool KML::Internal::parseDateTime(const kml_char* text, std::size_t length, std::int64_t& seconds)
+{
+	return length == 19 && readDateTime(text, ' ', seconds);
+}
+
+void KML::Internal::formatDateTime(std::int64_t seconds, kml_char* buffer)
+{
+	std::int64_t days = seconds / 86400;
+	std::int64_t time = seconds % 86400;
+	if (time < 0)
+	{
+		time += 86400;
+		days--;
+	}
+
+	//the inverse of daysFromCivil
+	days += 719468;
+	const std::int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+	const std::int64_t doe = days - era * 146097;
+	const std::int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	const std::int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	const std::int64_t mp = (5 * doy + 2) / 153;
+	const std::int32_t day = static_cast<std::int32_t>(doy - (153 * mp + 2) / 5 + 1);
+	const std::int32_t month = static_cast<std::int32_t>(mp < 10 ? mp + 3 : mp - 9);
+	const std::int32_t year = static_cast<std::int32_t>(yoe + era * 400 + (month <= 2));
+
+	auto put = [](kml_char* out, std::int32_t value, std::size_t count) {
+		for (std::size_t i = count; i-- > 0; )
+		{
+			out[i] = static_cast<kml_char>('0' + value % 10);
+			value /= 10;
+		}
+	};
+	put(buffer, year, 4);
+	buffer[4] = '-';
+	put(buffer + 5, month, 2);
+	buffer[7] = '-';
+	put(buffer + 8, day, 2);
+	buffer[10] = 'T';
+	put(buffer + 11, static_cast<std::int32_t>(time / 3600), 2);
+	buffer[13] = ':';
+	put(buffer + 14, static_cast<std::int32_t>((time / 60) % 60), 2);
+	buffer[16] = ':';
+	put(buffer + 17, static_cast<std::int32_t>(time % 60), 2);
 }
 
 
@@ -151,426 +827,1818 @@ pathToString(const kmlFs::path& path)
 }
 
 
-constexpr std::size_t BUFFER_SIZE = 4096;
+#ifdef _MSC_VER
 
-std::vector<unsigned char> extractFile(const kmlFs::path& input, const std::string& fileToExtract)
+KML::Internal::MappedFile::MappedFile(const kmlFs::path& path)
+	: data(nullptr),
+	  size(0),
+	  m_file(INVALID_HANDLE_VALUE),
+	  m_mapping(nullptr)
 {
-	if (!fs::exists(input))
-		return {};
+	m_file = CreateFileW(path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (m_file == INVALID_HANDLE_VALUE)
+		return;
+
+	LARGE_INTEGER fileSize;
+	//empty files can't be mapped, let the caller fall back to reading the file
+	if (!GetFileSizeEx(m_file, &fileSize) || fileSize.QuadPart == 0)
+		return;
+
+	m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!m_mapping)
+		return;
+
+	data = static_cast<const XMLByte*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+	if (data)
+		size = static_cast<std::size_t>(fileSize.QuadPart);
+}
 
-	//buffers for extraction
-	char currentFilename[512];
-	void* buffer = operator new(BUFFER_SIZE);
-	unz_file_info info;
+KML::Internal::MappedFile::~MappedFile()
+{
+	if (data)
+		UnmapViewOfFile(data);
+	if (m_mapping)
+		CloseHandle(m_mapping);
+	if (m_file != INVALID_HANDLE_VALUE)
+		CloseHandle(m_file);
+}
 
-	//open the archive
-	auto mcontext_ = unzOpen(input.string().c_str());
-	//open the first file in the archive
-	std::int32_t error = unzGoToFirstFile(mcontext_);
-	std::vector<unsigned char> data;
+#else
 
-	while (error == UNZ_OK)
+KML::Internal::MappedFile::MappedFile(const kmlFs::path& path)
+	: data(nullptr),
+	  size(0)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return;
+
+	struct stat st;
+	//empty files can't be mapped, let the caller fall back to reading the file
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+	{
+		void* mapping = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapping != MAP_FAILED)
+		{
+			//the parser reads the file front to back, let the kernel read ahead aggressively
+			madvise(mapping, static_cast<std::size_t>(st.st_size), MADV_SEQUENTIAL);
+			data = static_cast<const XMLByte*>(mapping);
+			size = static_cast<std::size_t>(st.st_size);
+		}
+	}
+
+	//the mapping stays valid after the descriptor is closed
+	close(fd);
+}
+
+KML::Internal::MappedFile::~MappedFile()
+{
+	if (data)
+		munmap(const_cast<XMLByte*>(data), size);
+}
+
+#endif
+
+
+//the central directory is indexed once when the archive is opened
+class KmzArchive
+{
+public:
+	explicit KmzArchive(const kmlFs::path& path)
+		: m_path(path),
+		  m_entryOpen(false)
+	{
+		m_archive = unzOpen64(path.string().c_str());
+		if (!m_archive)
+			return;
+
+		char currentFilename[512];
+		unz_file_info64 info;
+		unz64_file_pos position;
+		//open the first file in the archive
+		std::int32_t error = unzGoToFirstFile(m_archive);
+		while (error == UNZ_OK)
+		{
+			//get the name of the current file
+			if (unzGetCurrentFileInfo64(m_archive, &info, currentFilename, sizeof(currentFilename), 0, 0, 0, 0) == UNZ_OK &&
+				unzGetFilePos64(m_archive, &position) == UNZ_OK)
+			{
+				//keep the first entry if the archive has names that only differ by case
+				m_entries.emplace(boost::to_lower_copy(std::string(currentFilename)), position);
+			}
+
+			//go to the next file in the archive
+			error = unzGoToNextFile(m_archive);
+		}
+	}
+
+	KmzArchive(const KmzArchive&) = delete;
+	KmzArchive& operator=(const KmzArchive&) = delete;
+
+	~KmzArchive()
+	{
+		if (m_archive)
+		{
+			if (m_entryOpen)
+				unzCloseCurrentFile(m_archive);
+			unzClose(m_archive);
+		}
+	}
+
+	//the name is matched case insensitively, false if there is no entry with the name or it is empty
+	bool openEntry(const std::string& fileToExtract)
+	{
+		if (!m_archive)
+			return false;
+
+		if (m_entryOpen)
+		{
+			unzCloseCurrentFile(m_archive);
+			m_entryOpen = false;
+		}
+
+		auto entry = m_entries.find(boost::to_lower_copy(fileToExtract));
+		if (entry == m_entries.end() || unzGoToFilePos64(m_archive, &entry->second) != UNZ_OK)
+			return false;
+		//an empty document is as invalid as a missing one
+		unz_file_info64 info;
+		if (unzGetCurrentFileInfo64(m_archive, &info, nullptr, 0, nullptr, 0, nullptr, 0) != UNZ_OK || info.uncompressed_size == 0)
+			return false;
+
+		m_entryOpen = unzOpenCurrentFile(m_archive) == UNZ_OK;
+		return m_entryOpen;
+	}
+
+	unzFile handle() const { return m_archive; }
+	const kmlFs::path& path() const { return m_path; }
+
+private:
+	unzFile m_archive;
+	kmlFs::path m_path;
+	bool m_entryOpen;
+	std::unordered_map<std::string, unz64_file_pos> m_entries;
+};
+
+
+//inflates the open entry as the parser asks for data so it is never held in memory
+class KmzEntryInputStream : public xercesc::BinInputStream
+{
+public:
+	explicit KmzEntryInputStream(const KmzArchive* archive)
+		: m_archive(archive),
+		  m_position(0)
+	{
+	}
+
+	XMLFilePos curPos() const override { return m_position; }
+
+	XMLSize_t readBytes(XMLByte* const toFill, const XMLSize_t maxToRead) override
+	{
+		//unzReadCurrentFile reports the count as an int so limit the size of each read
+		auto toRead = static_cast<unsigned>(std::min<XMLSize_t>(maxToRead, std::numeric_limits<std::int32_t>::max()));
+		auto readCount = unzReadCurrentFile(m_archive->handle(), toFill, toRead);
+		if (readCount < 0)
+			throw kmlFs::filesystem_error("Invalid KMZ file", m_archive->path(), std::error_code());
+		m_position += static_cast<XMLFilePos>(readCount);
+		return static_cast<XMLSize_t>(readCount);
+	}
+
+	const XMLCh* getContentType() const override { return nullptr; }
+
+private:
+	const KmzArchive* m_archive;
+	XMLFilePos m_position;
+};
+
+
+class KmzEntryInputSource : public xercesc::InputSource
+{
+public:
+	KmzEntryInputSource(const KmzArchive* archive, const XMLCh* const systemId, xercesc::MemoryManager* const manager)
+		: InputSource(systemId, manager),
+		  m_archive(archive)
+	{
+	}
+
+	xercesc::BinInputStream* makeStream() const override
+	{
+		return new KmzEntryInputStream(m_archive);
+	}
+
+private:
+	const KmzArchive* m_archive;
+};
+
+
+constexpr std::size_t DEFLATE_BLOCK_SIZE = 128 * 1024;
+constexpr std::size_t DEFLATE_DICTIONARY_SIZE = 32 * 1024;
+
+//raw deflate data that can be concatenated with the blocks around it, primed with the end of the previous block
+static DeflateBlock deflateBlock(const std::vector<std::uint8_t>& input, const std::vector<std::uint8_t>& dictionary, std::int32_t level, bool last)
+{
+	DeflateBlock block;
+	block.length = input.size();
+	block.crc = crc32(crc32(0L, Z_NULL, 0), input.data(), static_cast<uInt>(input.size()));
+
+	z_stream stream = {};
+	//raw deflate, the zip entry provides the framing
+	if (deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		throw std::runtime_error("Unable to initialize compression");
+	//let matches reach back into the previous block like they would in a single stream
+	if (dictionary.size())
+		deflateSetDictionary(&stream, dictionary.data(), static_cast<uInt>(dictionary.size()));
+
+	block.data.resize(deflateBound(&stream, static_cast<uLong>(input.size())) + 16);
+	stream.next_in = const_cast<Bytef*>(input.data());
+	stream.avail_in = static_cast<uInt>(input.size());
+	stream.next_out = block.data.data();
+	stream.avail_out = static_cast<uInt>(block.data.size());
+
+	//blocks other than the last end on a byte boundary so they can simply be appended to each other
+	int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+	int result;
+	while (true)
+	{
+		result = deflate(&stream, flush);
+		if (result == Z_STREAM_ERROR || (last ? result == Z_STREAM_END : stream.avail_out != 0))
+			break;
+		if (stream.avail_out == 0)
+		{
+			block.data.resize(block.data.size() * 2);
+			stream.next_out = block.data.data() + stream.total_out;
+			stream.avail_out = static_cast<uInt>(block.data.size() - stream.total_out);
+		}
+	}
+	block.data.resize(stream.total_out);
+	deflateEnd(&stream);
+
+	if (result == Z_STREAM_ERROR)
+		throw std::runtime_error("Unable to compress KMZ data");
+
+	return block;
+}
+
+
+class KML::Internal::DeflatePool
+{
+public:
+	explicit DeflatePool(std::uint32_t threads)
+		: m_stop(false)
+	{
+		try
+		{
+			for (std::uint32_t i = 0; i < threads; i++)
+				m_threads.emplace_back([this] { run(); });
+		}
+		catch (...)
+		{
+			//the threads that did start have to be joined before they are destroyed
+			stop();
+			throw;
+		}
+	}
+
+	DeflatePool(const DeflatePool&) = delete;
+	DeflatePool& operator=(const DeflatePool&) = delete;
+
+	~DeflatePool()
+	{
+		stop();
+	}
+
+	std::future<DeflateBlock> submit(std::packaged_task<DeflateBlock()> task)
+	{
+		auto result = task.get_future();
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_tasks.push_back(std::move(task));
+		}
+		m_condition.notify_one();
+		return result;
+	}
+
+	std::size_t size() const { return m_threads.size(); }
+
+private:
+	//the queued tasks are finished before the threads exit
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_condition.notify_all();
+		for (auto& thread : m_threads)
+		{
+			if (thread.joinable())
+				thread.join();
+		}
+	}
+
+	void run()
+	{
+		while (true)
+		{
+			std::packaged_task<DeflateBlock()> task;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_condition.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+				if (m_tasks.empty())
+					return;
+				task = std::move(m_tasks.front());
+				m_tasks.pop_front();
+			}
+			task();
+		}
+	}
+
+	std::vector<std::thread> m_threads;
+	std::deque<std::packaged_task<DeflateBlock()>> m_tasks;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	bool m_stop;
+};
+
+
+KML::Internal::ParallelDeflate::ParallelDeflate(std::int32_t level, std::uint32_t threads, Output output)
+	: m_level(level),
+	  m_output(std::move(output)),
+	  m_pool(std::make_unique<DeflatePool>(std::max(threads, 1U))),
+	  m_crc(crc32(0L, Z_NULL, 0)),
+	  m_length(0)
+{
+	m_block.reserve(DEFLATE_BLOCK_SIZE);
+}
+
+KML::Internal::ParallelDeflate::~ParallelDeflate()
+{
+}
+
+void KML::Internal::ParallelDeflate::write(const std::uint8_t* data, std::size_t length)
+{
+	while (length > 0)
+	{
+		auto count = std::min(length, DEFLATE_BLOCK_SIZE - m_block.size());
+		m_block.insert(m_block.end(), data, data + count);
+		data += count;
+		length -= count;
+		if (m_block.size() == DEFLATE_BLOCK_SIZE)
+			submitBlock(false);
+	}
+}
+
+void KML::Internal::ParallelDeflate::finish()
+{
+	try
+	{
+		submitBlock(true);
+		while (m_pending.size())
+			writeBlock();
+	}
+	catch (...)
+	{
+		//the remaining blocks have to finish before their buffers go away
+		for (auto& pending : m_pending)
+			pending.wait();
+		m_pending.clear();
+		throw;
+	}
+}
+
+void KML::Internal::ParallelDeflate::submitBlock(bool last)
+{
+	std::vector<std::uint8_t> dictionary = std::move(m_dictionary);
+	//the end of this block primes the compression of the next one
+	m_dictionary.assign(m_block.size() > DEFLATE_DICTIONARY_SIZE ? m_block.end() - DEFLATE_DICTIONARY_SIZE : m_block.begin(), m_block.end());
+	if (m_dictionary.size() < DEFLATE_DICTIONARY_SIZE && dictionary.size())
+	{
+		//a short block still has to carry the window forward from the blocks before it
+		auto keep = std::min(dictionary.size(), DEFLATE_DICTIONARY_SIZE - m_dictionary.size());
+		m_dictionary.insert(m_dictionary.begin(), dictionary.end() - keep, dictionary.end());
+	}
+
+	std::int32_t level = m_level;
+	std::packaged_task<DeflateBlock()> task([input = std::move(m_block), dictionary = std::move(dictionary), level, last]() {
+		return deflateBlock(input, dictionary, level, last);
+	});
+	m_block = std::vector<std::uint8_t>();
+	m_block.reserve(DEFLATE_BLOCK_SIZE);
+	m_pending.push_back(m_pool->submit(std::move(task)));
+
+	//keep every thread busy without queueing up the whole document
+	while (m_pending.size() > m_pool->size() * 2)
+		writeBlock();
+}
+
+void KML::Internal::ParallelDeflate::writeBlock()
+{
+	auto block = m_pending.front().get();
+	m_pending.pop_front();
+	m_output(block.data.data(), block.data.size());
+	m_crc = crc32_combine(m_crc, block.crc, static_cast<z_off_t>(block.length));
+	m_length += block.length;
+}
+
+
+//compresses into a zip entry while the document is written, with more than one thread blocks are deflated in parallel and stitched into one stream the way pigz does
+class ZipFormatTarget : public xercesc::XMLFormatTarget
+{
+public:
+	ZipFormatTarget(const kmlFs::path& zipPath, const std::string& filename, std::int32_t level, std::uint32_t threads)
+		: m_level(level < 0 ? Z_DEFAULT_COMPRESSION : std::min(level, 9)),
+		  m_entryOpen(false)
 	{
-		//get the name of the current file
-		unzGetCurrentFileInfo(mcontext_,
-			&info, currentFilename, sizeof(currentFilename), 0, 0, 0, 0);
+		//open the archive for writing
+		m_archive = zipOpen64(zipPath.string().c_str(), APPEND_STATUS_CREATE);
+		if (!m_archive)
+			throw kmlFs::filesystem_error("Unable to create KMZ file", zipPath, std::error_code());
 
-		//create the output filename
-		std::string name = std::string(currentFilename);
+		//set the last modified time
+		zip_fileinfo zi = { 0 };
+		time_t rawTime;
+		time(&rawTime);
 
-		//we have found the file we want to exract
-		if (boost::iequals(fileToExtract, name))
+#ifdef _MSC_VER
+		struct tm gmt;
+		gmtime_s(&gmt, &rawTime);
+#else
+		struct tm gmt;
+		gmtime_r(&rawTime, &gmt);
+#endif
+
+		zi.tmz_date.tm_sec = gmt.tm_sec;
+		zi.tmz_date.tm_min = gmt.tm_min;
+		zi.tmz_date.tm_hour = gmt.tm_hour;
+		zi.tmz_date.tm_mday = gmt.tm_mday;
+		zi.tmz_date.tm_mon = gmt.tm_mon;
+		zi.tmz_date.tm_year = gmt.tm_year;
+
+		//the final size isn't known yet so the entry is always opened with zip64 extra fields,
+		//otherwise a document over 4GiB would be written with truncated sizes
+		int err;
+		if (threads > 1)
+		{
+			//the data will be compressed here so minizip has to store it as is
+			try
+			{
+				m_deflate = std::make_unique<ParallelDeflate>(m_level, threads, [this](const std::uint8_t* data, std::size_t length) { writeEntry(data, length); });
+			}
+			catch (...)
+			{
+				zipClose(m_archive, nullptr);
+				throw;
+			}
+			err = zipOpenNewFileInZip2_64(m_archive, filename.c_str(),
+				&zi, nullptr, 0, nullptr, 0, nullptr, Z_DEFLATED, m_level, 1, 1);
+		}
+		else
+			err = zipOpenNewFileInZip64(m_archive, filename.c_str(),
+				&zi, nullptr, 0, nullptr, 0, nullptr, Z_DEFLATED, m_level, 1);
+		m_entryOpen = err == ZIP_OK;
+	}
+
+	ZipFormatTarget(const ZipFormatTarget&) = delete;
+	ZipFormatTarget& operator=(const ZipFormatTarget&) = delete;
+
+	~ZipFormatTarget() override
+	{
+		try
+		{
+			finish();
+		}
+		catch (...)
 		{
-			unzOpenCurrentFile(mcontext_);
+		}
+
+		//close the archive
+		zipClose(m_archive, nullptr);
+	}
+
+	void writeChars(const XMLByte* const toWrite, const XMLSize_t count, XMLFormatter* const) override
+	{
+		if (!m_entryOpen)
+			return;
+
+		if (m_deflate)
+			m_deflate->write(toWrite, count);
+		else
+			writeEntry(toWrite, count);
+	}
+
+	bool finish()
+	{
+		if (!m_entryOpen)
+			return false;
 
-			std::int32_t readCount = 0;
-			std::int32_t totalRead = 0;
-			do
+		bool success;
+		if (m_deflate)
+		{
+			try
 			{
-				//not sure this is the most efficient way to do this
-				data.resize(totalRead + BUFFER_SIZE);
-				readCount = unzReadCurrentFile(mcontext_, (char*)(&data[totalRead]), BUFFER_SIZE);
-				totalRead += readCount;
-				if (readCount < BUFFER_SIZE)
+				m_deflate->finish();
+			}
+			catch (...)
+			{
+				zipCloseFileInZipRaw64(m_archive, m_deflate->length(), m_deflate->crc());
+				m_entryOpen = false;
+				throw;
+			}
+			success = zipCloseFileInZipRaw64(m_archive, m_deflate->length(), m_deflate->crc()) == ZIP_OK;
+		}
+		else
+			//close the input and output files
+			success = zipCloseFileInZip(m_archive) == ZIP_OK;
+		m_entryOpen = false;
+		return success;
+	}
+
+private:
+	void writeEntry(const XMLByte* data, XMLSize_t count)
+	{
+		//zipWriteInFileInZip takes a 32-bit length
+		while (count > 0)
+		{
+			auto length = static_cast<unsigned>(std::min<XMLSize_t>(count, std::numeric_limits<std::uint32_t>::max()));
+			if (zipWriteInFileInZip(m_archive, data, length) != ZIP_OK)
+				throw std::runtime_error("Unable to write to KMZ file");
+			data += length;
+			count -= length;
+		}
+	}
+
+	zipFile m_archive;
+	std::int32_t m_level;
+	bool m_entryOpen;
+	std::unique_ptr<ParallelDeflate> m_deflate;
+};
+
+
+struct TagName
+{
+	const char* name;
+	KmlTag tag;
+};
+
+static constexpr TagName TAG_NAMES[] = {
+	{ "kml", KmlTag::Kml },
+	{ "document", KmlTag::Document },
+	{ "name", KmlTag::Name },
+	{ "networklink", KmlTag::NetworkLink },
+	{ "link", KmlTag::Link },
+	{ "href", KmlTag::Href },
+	{ "folder", KmlTag::Folder },
+	{ "schema", KmlTag::Schema },
+	{ "simplefield", KmlTag::SimpleField },
+	{ "placemark", KmlTag::Placemark },
+	{ "style", KmlTag::Style },
+	{ "extendeddata", KmlTag::ExtendedData },
+	{ "polygon", KmlTag::Polygon },
+	{ "multigeometry", KmlTag::MultiGeometry },
+	{ "linestring", KmlTag::LineString },
+	{ "timestamp", KmlTag::TimeStamp },
+	{ "when", KmlTag::When },
+	{ "linestyle", KmlTag::LineStyle },
+	{ "polystyle", KmlTag::PolyStyle },
+	{ "color", KmlTag::Color },
+	{ "fill", KmlTag::Fill },
+	{ "schemadata", KmlTag::SchemaData },
+	{ "simpledata", KmlTag::SimpleData },
+	{ "outerboundaryis", KmlTag::OuterBoundaryIs },
+	{ "linearring", KmlTag::LinearRing },
+	{ "coordinates", KmlTag::Coordinates },
+	{ "entry", KmlTag::Entry },
+};
+
+static constexpr std::size_t TAG_NAME_COUNT = sizeof(TAG_NAMES) / sizeof(TAG_NAMES[0]);
+static constexpr int TAG_TABLE_BITS = 6;
+static constexpr std::size_t TAG_TABLE_SIZE = std::size_t(1) << TAG_TABLE_BITS;
+//found by search so every tag name has its own slot
+static constexpr std::uint32_t TAG_HASH_SEED = 759;
+
+//lower case FNV-1a
+static constexpr std::uint32_t tagHashStep(std::uint32_t hash, std::uint32_t c)
+{
+	if (c >= 'A' && c <= 'Z')
+		c += 'a' - 'A';
+	return (hash ^ c) * 16777619u;
+}
+
+//the low bits of FNV-1a only depend on the low bits of the input so the slot is taken from the top
+static constexpr std::size_t tagSlot(std::uint32_t hash)
+{
+	return hash >> (32 - TAG_TABLE_BITS);
+}
+
+static constexpr std::size_t tagSlot(const char* name)
+{
+	std::uint32_t hash = TAG_HASH_SEED;
+	for (; *name; name++)
+		hash = tagHashStep(hash, static_cast<unsigned char>(*name));
+	return tagSlot(hash);
+}
+
+struct TagTable
+{
+	//TAG_NAME_COUNT if the slot is empty
+	std::uint8_t slots[TAG_TABLE_SIZE];
+	bool perfect;
+};
+
+static constexpr TagTable buildTagTable()
+{
+	TagTable table{};
+	for (auto& slot : table.slots)
+		slot = TAG_NAME_COUNT;
+	table.perfect = true;
+	for (std::size_t i = 0; i < TAG_NAME_COUNT; i++)
+	{
+		auto slot = tagSlot(TAG_NAMES[i].name);
+		if (table.slots[slot] != TAG_NAME_COUNT)
+			table.perfect = false;
+		table.slots[slot] = static_cast<std::uint8_t>(i);
+	}
+	return table;
+}
+
+static constexpr TagTable TAG_TABLE = buildTagTable();
+static_assert(TAG_TABLE.perfect, "two tag names hash to the same slot, pick a different TAG_HASH_SEED");
+
+KmlTag KML::Internal::lookupTag(const XMLCh* name)
+{
+	std::uint32_t hash = TAG_HASH_SEED;
+	for (auto c = name; *c; c++)
+	{
+		//none of the tags contain anything but ASCII letters
+		if (*c >= 0x80)
+			return KmlTag::Unknown;
+		hash = tagHashStep(hash, static_cast<std::uint32_t>(*c));
+	}
+
+	auto index = TAG_TABLE.slots[tagSlot(hash)];
+	if (index == TAG_NAME_COUNT)
+		return KmlTag::Unknown;
+
+	//the slot only says which tag it could be, the name still has to match
+	auto expected = TAG_NAMES[index].name;
+	for (auto c = name; *c || *expected; c++, expected++)
+	{
+		auto lower = static_cast<std::uint32_t>(*c);
+		if (lower >= 'A' && lower <= 'Z')
+			lower += 'a' - 'A';
+		if (lower != static_cast<unsigned char>(*expected))
+			return KmlTag::Unknown;
+	}
+	return TAG_NAMES[index].tag;
+}
+
+
+xercesc::DOMElement* KML::Internal::ElementChildren::find(KmlTag tag) const
+{
+	for (auto child : *this)
+	{
+		if (child.tag == tag)
+			return child.element;
+	}
+
+	return nullptr;
+}
+
+
+constexpr std::size_t WRITE_BUFFER_SIZE = 64 * 1024;
+
+//CRLF and lone CRs replaced with LF the way the parser reads them, for text referenced in the input
+template<typename StringT>
+static void appendLineEnds(const char* p, const char* end, StringT& out)
+{
+	while (p < end)
+	{
+		auto cr = static_cast<const char*>(std::memchr(p, '\r', end - p));
+		if (!cr)
+			break;
+		out.append(p, cr);
+		out.push_back('\n');
+		p = cr + 1;
+		if (p < end && *p == '\n')
+			p++;
+	}
+	out.append(p, end);
+}
+
+//one space between the items of a whitespace separated list and none at the ends
+template<typename CharT, typename StringT>
+static void normalizeSpace(const CharT* p, const CharT* end, StringT& out)
+{
+	out.clear();
+	out.reserve(end - p);
+	while (p < end)
+	{
+		while (p < end && isSpace(*p))
+			p++;
+		const CharT* start = p;
+		while (p < end && !isSpace(*p))
+			p++;
+		if (p > start)
+		{
+			if (out.size())
+				out.push_back(' ');
+			out.append(start, p);
+		}
+	}
+}
+
+KML::Internal::KmlWriter::KmlWriter(xercesc::XMLFormatTarget* target, bool prettyPrint, bool normalizeLists, std::int32_t coordinatePrecision)
+	: m_target(target),
+	  m_prettyPrint(prettyPrint),
+	  m_normalizeLists(normalizeLists),
+	  m_coordinatePrecision(coordinatePrecision < 0 ? -1 : std::min(coordinatePrecision, 15)),
+	  m_startTagOpen(false),
+	  m_tuples(nullptr)
+{
+	m_buffer.reserve(WRITE_BUFFER_SIZE + 1024);
+}
+
+KML::Internal::KmlWriter::~KmlWriter()
+{
+	//the writer can be destroyed while an exception from the target is unwinding
+	try
+	{
+		flush();
+	}
+	catch (...)
+	{
+	}
+	if (m_tuples)
+		delete m_tuples;
+}
+
+void KML::Internal::KmlWriter::flush()
+{
+	if (m_buffer.size())
+	{
+		m_target->writeChars(reinterpret_cast<const XMLByte*>(m_buffer.data()), m_buffer.size(), nullptr);
+		m_buffer.clear();
+	}
+}
+
+void KML::Internal::KmlWriter::startDocument()
+{
+	m_buffer.append("<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\" ?>");
+}
+
+void KML::Internal::KmlWriter::endDocument()
+{
+	if (m_prettyPrint)
+		m_buffer.push_back('\n');
+	flush();
+}
+
+void KML::Internal::KmlWriter::closeStartTag()
+{
+	if (m_startTagOpen)
+	{
+		m_buffer.push_back('>');
+		m_startTagOpen = false;
+	}
+}
+
+void KML::Internal::KmlWriter::newLine(std::size_t depth)
+{
+	if (m_prettyPrint)
+	{
+		m_buffer.push_back('\n');
+		m_buffer.append(depth * 2, ' ');
+	}
+}
+
+void KML::Internal::KmlWriter::appendName(const xerces_char* name)
+{
+	//element and attribute names are all ASCII
+	for (; *name; name++)
+		m_buffer.push_back(static_cast<char>(*name));
+}
+
+//the replacements DOMLSSerializer makes, attribute values keep '>' but have their whitespace replaced
+static inline const char* escapeFor(std::uint32_t c, bool isAttribute)
+{
+	switch (c)
+	{
+	case '&':
+		return "&amp;";
+	case '<':
+		return "&lt;";
+	case '>':
+		return isAttribute ? nullptr : "&gt;";
+	case '"':
+		return isAttribute ? "&quot;" : nullptr;
+	case '\r':
+		return "&#xD;";
+	case '\n':
+		return isAttribute ? "&#xA;" : nullptr;
+	case '\t':
+		return isAttribute ? "&#x9;" : nullptr;
+	default:
+		return nullptr;
+	}
+}
+
+void KML::Internal::KmlWriter::appendEscaped(const kml_string& value, bool isAttribute)
+{
+#ifdef KML_UTF8_MODEL
+	//the text is already UTF-8, only the markup characters need to be replaced
+	std::size_t start = 0;
+	auto length = value.length();
+	for (std::size_t i = 0; i < length; i++)
+	{
+		auto replacement = escapeFor(static_cast<unsigned char>(value[i]), isAttribute);
+		if (!replacement)
+			continue;
+		m_buffer.append(value.data() + start, i - start);
+		m_buffer.append(replacement);
+		start = i + 1;
+	}
+	m_buffer.append(value.data() + start, length - start);
+#else
+	auto length = value.length();
+	for (std::size_t i = 0; i < length; i++)
+	{
+		std::uint32_t c = value[i];
+		if (c < 0x80)
+		{
+			if (auto replacement = escapeFor(c, isAttribute))
+				m_buffer.append(replacement);
+			else
+				m_buffer.push_back(static_cast<char>(c));
+		}
+		else if (c < 0x800)
+		{
+			m_buffer.push_back(static_cast<char>(0xc0 | (c >> 6)));
+			m_buffer.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+		}
+		else
+		{
+			//combine surrogate pairs into a single code point
+			if (c >= 0xd800 && c < 0xdc00 && (i + 1) < length && value[i + 1] >= 0xdc00 && value[i + 1] < 0xe000)
+			{
+				c = 0x10000 + ((c - 0xd800) << 10) + (value[i + 1] - 0xdc00);
+				i++;
+				m_buffer.push_back(static_cast<char>(0xf0 | (c >> 18)));
+				m_buffer.push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3f)));
+			}
+			//a surrogate without its other half has no UTF-8 encoding, Xerces's transcoder rejects it too
+			else if (c >= 0xd800 && c < 0xe000)
+				throw std::range_error("invalid UTF-16 string");
+			else
+				m_buffer.push_back(static_cast<char>(0xe0 | (c >> 12)));
+			m_buffer.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3f)));
+			m_buffer.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+		}
+	}
+#endif
+}
+
+void KML::Internal::KmlWriter::startElement(const xerces_char* name)
+{
+	closeStartTag();
+	if (m_elements.size())
+		m_elements.back().hasChildren = true;
+	newLine(m_elements.size());
+
+	m_buffer.push_back('<');
+	appendName(name);
+	m_elements.push_back({ name, false });
+	m_startTagOpen = true;
+}
+
+void KML::Internal::KmlWriter::endElement()
+{
+	auto element = m_elements.back();
+	m_elements.pop_back();
+
+	if (m_startTagOpen)
+	{
+		m_buffer.append("/>");
+		m_startTagOpen = false;
+	}
+	else
+	{
+		if (element.hasChildren)
+			newLine(m_elements.size());
+		m_buffer.append("</");
+		appendName(element.name);
+		m_buffer.push_back('>');
+	}
+
+	if (m_buffer.size() >= WRITE_BUFFER_SIZE)
+		flush();
+}
+
+void KML::Internal::KmlWriter::attribute(const xerces_char* name, const kml_string& value)
+{
+	m_buffer.push_back(' ');
+	appendName(name);
+	m_buffer.append("=\"");
+	appendEscaped(value, true);
+	m_buffer.push_back('"');
+}
+
+void KML::Internal::KmlWriter::text(const kml_string& value)
+{
+	//an empty text node still closes the start tag, the same as setTextContent
+	closeStartTag();
+	appendEscaped(value, false);
+}
+
+void KML::Internal::KmlWriter::textElement(const xerces_char* name, const kml_string& value)
+{
+	startElement(name);
+	text(value);
+	endElement();
+}
+
+void KML::Internal::KmlWriter::escapedTextElement(const xerces_char* name, const char* text, std::size_t length)
+{
+	startElement(name);
+	closeStartTag();
+	appendLineEnds(text, text + length, m_buffer);
+	endElement();
+}
+
+void KML::Internal::KmlWriter::listElement(const xerces_char* name, const kml_string& value)
+{
+	if (m_normalizeLists)
+	{
+		normalizeSpace(value.data(), value.data() + value.length(), m_list);
+		textElement(name, m_list);
+	}
+	else
+		textElement(name, value);
+}
+
+void KML::Internal::KmlWriter::escapedListElement(const xerces_char* name, const char* text, std::size_t length)
+{
+	if (m_normalizeLists)
+	{
+		normalizeSpace(text, text + length, m_asciiList);
+		escapedTextElement(name, m_asciiList.data(), m_asciiList.length());
+	}
+	else
+		escapedTextElement(name, text, length);
+}
+
+
+void Java::Internal::read_job_directory(const kmlFs::path& path, std::string& job_directory)
+{
+	if (kmlFs::exists(path))
+	{
+		PoolMemoryManager memoryManager;
+		XercesDOMParser mParser(nullptr, &memoryManager);
+		mParser.setValidationScheme(XercesDOMParser::Val_Never);
+		mParser.setDoNamespaces(false);
+		mParser.setDoSchema(false);
+		mParser.setLoadExternalDTD(false);
+#ifdef XERCES_USE_U
+		std::u16string str = path.u16string();
+#else
+		std::string str = path.string();
+#endif
+		mParser.parse(str.c_str());
+
+		xercesc::DOMDocument* dom = mParser.getDocument();
+		xercesc::DOMElement* map = dom->getDocumentElement();
+
+		for (auto child : ElementChildren(map))
+		{
+			if (child.tag == KmlTag::Entry)
+			{
+				xerces_string key = child.element->getAttribute(_X("key"));
+				if (iequals(key, xerces_string(_X("job_directory"))))
 				{
-					data.resize(totalRead);
+					xerces_string value = child.element->getAttribute(_X("value"));
+#ifdef XERCES_USE_U
+					job_directory = utf16_to_utf8(value);
+#else
+					job_directory = value;
+#endif
 					break;
 				}
-			} while (readCount > 0);
+			}
+		}
+	}
+}
+
+
+KML::Internal::Input::InputKmlFile::InputKmlFile(kmlFs::path input, bool streaming, bool passthrough)
+	: document(nullptr),
+	  m_arena(new ModelArena()),
+	  m_source(nullptr)
+{
+	try
+	{
+		initialize(input, "doc.kml", streaming, passthrough);
+	}
+	catch (...)
+	{
+		if (document)
+			delete document;
+		delete m_arena;
+		throw;
+	}
+}
+
+KML::Internal::Input::InputKmlFile::~InputKmlFile()
+{
+	//the destructors free anything that was allocated on the heap, the arena's blocks go after
+	if (document)
+		delete document;
+	delete m_arena;
+	//the document references the mapping so it has to be released last
+	if (m_source)
+		delete m_source;
+}
 
-			unzCloseCurrentFile(mcontext_);
+bool KML::Internal::Input::InputKmlFile::initialize(const kmlFs::path& input, const std::string& kmzPath, bool streaming, bool passthrough)
+{
+	if (kmlFs::exists(input))
+	{
+#ifdef XERCES_USE_U
+		std::u16string str = input.u16string();
+#else
+		std::string str = input.string();
+#endif
+
+		//the archive or mapping is shared by every document a NetworkLink leads to
+		std::unique_ptr<KmzArchive> archive;
+		std::unique_ptr<MappedFile> mapped;
+		if (boost::iequals(input.extension().string(), ".kmz"))
+			archive = std::make_unique<KmzArchive>(input);
+		else
+			//parse straight out of the page cache instead of copying the file through a read buffer
+			mapped = std::make_unique<MappedFile>(input);
+		//geometry can only reference a mapped file that is being streamed, anything else unmaps it when it's read
+		passthrough = streaming && passthrough && mapped && mapped->isOpen();
+
+		std::string entry = kmzPath;
+		//a link back to a document that has already been read would never end
+		std::unordered_set<std::string> visited;
+		while (visited.insert(boost::to_lower_copy(entry)).second)
+		{
+			ModelArena::Scope scope(m_arena);
+			//everything Xerces allocates while reading this document comes from here, it is
+			//declared first so it is released after the parser and its DOM
+			PoolMemoryManager memoryManager;
+			std::unique_ptr<InputSource> buf;
+			if (archive)
+			{
+				//inflate the document while it is being parsed
+				if (archive->openEntry(entry))
+					buf = std::make_unique<KmzEntryInputSource>(archive.get(), (pathToString(input.filename()) + _X(" (in memory)")).c_str(), &memoryManager);
+				else
+					throw kmlFs::filesystem_error("Invalid KMZ file", input, std::error_code());
+			}
+			else if (mapped->isOpen())
+				buf = std::make_unique<MemBufInputSource>(mapped->data, mapped->size, str.c_str(), false, &memoryManager);
+
+			if (streaming)
+			{
+				//build the model as the file is read, the DOM is never created
+				InputKmlHandler handler(this, passthrough ? mapped.get() : nullptr);
+				std::unique_ptr<SAX2XMLReader> reader(XMLReaderFactory::createXMLReader(&memoryManager));
+				reader->setFeature(XMLUni::fgSAX2CoreValidation, false);
+				reader->setFeature(XMLUni::fgSAX2CoreNameSpaces, false);
+				reader->setFeature(XMLUni::fgXercesSchema, false);
+				reader->setFeature(XMLUni::fgXercesLoadExternalDTD, false);
+				reader->setContentHandler(&handler);
+
+				if (buf)
+					reader->parse(*buf);
+				else
+					reader->parse(str.c_str());
+			}
+			else
+			{
+				XercesDOMParser mParser(nullptr, &memoryManager);
+				mParser.setValidationScheme(XercesDOMParser::Val_Never);
+				mParser.setDoNamespaces(false);
+				mParser.setDoSchema(false);
+				mParser.setLoadExternalDTD(false);
+
+				if (buf)
+					mParser.parse(*buf);
+				else
+					mParser.parse(str.c_str());
+
+				xercesc::DOMDocument* dom = mParser.getDocument();
+				xercesc::DOMElement* kml = dom->getDocumentElement();
+
+				ns = xerces_to_kml(kml->getAttribute(_X("xmlns")));
+
+				auto documentElement = ElementChildren(kml).find(KmlTag::Document);
+				if (documentElement)
+					document = new InputDocument(documentElement);
+			}
+
+			if (document && document->link.size() > 0)
+			{
+				entry = kml_to_utf8(document->link);
+				delete document;
+				document = nullptr;
+				ns.clear();
+				//the linked document gets a fresh arena so the one that was read is released
+				delete m_arena;
+				m_arena = nullptr;
+				m_arena = new ModelArena();
+
+				//read the linked document instead
+				continue;
+			}
 			break;
 		}
 
-		//go to the next file in the archive
-		error = unzGoToNextFile(mcontext_);
+		//coordinates in the model point into the mapping
+		if (passthrough)
+			m_source = mapped.release();
 	}
 
-	unzClose(mcontext_);
-	operator delete(buffer);
+	return document != nullptr;
+}
 
-	return data;
+KML::Internal::Input::InputKmlHandler::InputKmlHandler(InputKmlFile* file, const MappedFile* source)
+	: m_file(file),
+	  m_textDepth(0),
+	  m_localName(_K("Data")),
+	  m_document(nullptr),
+	  m_folder(nullptr),
+	  m_schema(nullptr),
+	  m_placemark(nullptr),
+	  m_style(nullptr),
+	  m_schemaData(nullptr),
+	  m_polygon(nullptr),
+	  m_linearRing(nullptr),
+	  m_lineString(nullptr),
+	  m_coordinates(nullptr),
+	  m_sourceCursor(nullptr),
+	  m_sourceEnd(nullptr),
+	  m_rawBegin(nullptr),
+	  m_rawEnd(nullptr)
+{
+	if (source)
+	{
+		m_sourceCursor = reinterpret_cast<const char*>(source->data);
+		m_sourceEnd = m_sourceCursor + source->size;
+	}
+}
+
+//the text of the next coordinates element in the input bytes, comments, CDATA, and processing instructions are skipped because they can contain anything
+static bool findCoordinates(const char*& cursor, const char* end, const char*& begin, const char*& textEnd)
+{
+	static constexpr char tag[] = "coordinates";
+	static constexpr std::size_t tagLength = sizeof(tag) - 1;
+
+	while (cursor < end)
+	{
+		auto p = static_cast<const char*>(std::memchr(cursor, '<', end - cursor));
+		if (!p)
+			break;
+		p++;
+
+		const char* terminator = nullptr;
+		if (end - p >= 3 && std::memcmp(p, "!--", 3) == 0)
+			terminator = "-->";
+		else if (end - p >= 8 && std::memcmp(p, "![CDATA[", 8) == 0)
+			terminator = "]]>";
+		else if (p < end && *p == '?')
+			terminator = "?>";
+		else if (p < end && *p == '!')
+			terminator = ">";
+		if (terminator)
+		{
+			auto length = std::strlen(terminator);
+			auto close = std::search(p, end, terminator, terminator + length);
+			cursor = close == end ? end : close + length;
+			continue;
+		}
+
+		cursor = p;
+		if (end - p <= static_cast<std::ptrdiff_t>(tagLength))
+			break;
+		bool match = true;
+		for (std::size_t i = 0; i < tagLength && match; i++)
+			match = std::tolower(static_cast<unsigned char>(p[i])) == tag[i];
+		char next = p[tagLength];
+		if (!match || (next != '>' && next != '/' && !isSpace(next)))
+			continue;
+
+		//find the end of the start tag, attribute values can contain a '>'
+		const char* q = p + tagLength;
+		char quote = 0;
+		for (; q < end; q++)
+		{
+			if (quote)
+			{
+				if (*q == quote)
+					quote = 0;
+			}
+			else if (*q == '"' || *q == '\'')
+				quote = *q;
+			else if (*q == '>')
+				break;
+		}
+		if (q == end)
+			break;
+
+		begin = q + 1;
+		if (q[-1] == '/')
+			textEnd = begin;
+		else
+		{
+			auto close = static_cast<const char*>(std::memchr(begin, '<', end - begin));
+			textEnd = close ? close : end;
+		}
+		cursor = textEnd;
+		return true;
+	}
+
+	cursor = end;
+	return false;
+}
+
+//do the input bytes read as exactly the parsed text and need no escaping, the parser has replaced
+//CRLF and lone CRs with LF
+static bool matchesSource(const xerces_string& text, const char* begin, const char* end)
+{
+	std::size_t i = 0;
+	for (const char* p = begin; p < end; p++, i++)
+	{
+		auto c = static_cast<unsigned char>(*p);
+		if (c >= 0x80 || c == '>')
+			return false;
+		if (c == '\r')
+		{
+			c = '\n';
+			if (p + 1 < end && p[1] == '\n')
+				p++;
+		}
+		if (i == text.length() || static_cast<std::uint32_t>(text[i]) != c)
+			return false;
+	}
+	return i == text.length();
 }
 
+static kml_string getAttribute(const xercesc::Attributes& attrs, const xerces_char* name)
+{
+	auto value = attrs.getValue(name);
+	return xerces_to_kml(value);
+}
 
-bool createZipFile(const kmlFs::path& zipPath, const std::string& filename, const XMLByte* data, const XMLSize_t dataLength)
+//mirrors the DOM constructors, returns the role the element plays and creates any model object it represents
+KML::Internal::Input::InputKmlHandler::Element KML::Internal::Input::InputKmlHandler::childElement(Frame& parent, KmlTag tag, const xercesc::Attributes& attrs)
 {
-	//open the archive for writing
-	auto mcontext_ = zipOpen64(zipPath.string().c_str(), APPEND_STATUS_CREATE);
+	switch (parent.element)
+	{
+	case Element::Kml:
+		//only the first document is read
+		if (!m_file->document && tag == KmlTag::Document)
+		{
+			m_document = m_file->document = new InputDocument();
+			m_document->id = getAttribute(attrs, _X("id"));
+			return Element::Document;
+		}
+		break;
+
+	case Element::Document:
+		if (!m_document->schema && tag == KmlTag::Schema)
+		{
+			m_schema = m_document->schema = new InputSchema();
+			m_schema->id = getAttribute(attrs, _X("id"));
+			m_schema->name = getAttribute(attrs, _X("name"));
+			return Element::Schema;
+		}
+		else if (!m_document->folder && (tag == KmlTag::Folder || tag == KmlTag::Document))
+		{
+			m_folder = m_document->folder = new InputFolder(kml_string());
+			return Element::Folder;
+		}
+		//the placemarks aren't in a folder they are directly in the document
+		else if (tag == KmlTag::Placemark)
+		{
+			if (!m_document->folder)
+			{
+				m_folder = m_document->folder = new InputFolder(m_localName);
+				if (m_document->schema)
+					m_folder->data.addFields(m_document->schema);
+			}
+			m_placemark = new InputPlacemark();
+			m_folder->placemark.push_back(m_placemark);
+			return Element::Placemark;
+		}
+		else if (tag == KmlTag::Name)
+			return Element::DocumentName;
+		else if (m_document->link.size() == 0 && tag == KmlTag::NetworkLink)
+			return Element::NetworkLink;
+		break;
+
+	case Element::NetworkLink:
+		if (!parent.childFound && tag == KmlTag::Link)
+		{
+			parent.childFound = true;
+			return Element::Link;
+		}
+		break;
+
+	case Element::Link:
+		if (!parent.childFound && tag == KmlTag::Href)
+		{
+			parent.childFound = true;
+			return Element::Href;
+		}
+		break;
+
+	case Element::Folder:
+		if (m_folder->name.length() == 0 && tag == KmlTag::Name)
+			return Element::FolderName;
+		else if (!m_folder->schema && tag == KmlTag::Schema)
+		{
+			m_schema = m_folder->schema = new InputSchema();
+			m_schema->id = getAttribute(attrs, _X("id"));
+			m_schema->name = getAttribute(attrs, _X("name"));
+			return Element::Schema;
+		}
+		else if (tag == KmlTag::Placemark)
+		{
+			m_placemark = new InputPlacemark();
+			m_folder->placemark.push_back(m_placemark);
+			return Element::Placemark;
+		}
+		break;
+
+	case Element::Schema:
+		if (tag == KmlTag::SimpleField)
+		{
+			auto field = new SimpleField();
+			field->name = getAttribute(attrs, _X("name"));
+			field->type = intern(XercesTextView(attrs.getValue(_X("type"))));
+			m_schema->simpleField.push_back(field);
+			if (m_folder && m_folder->schema == m_schema)
+				m_folder->data.column(field->name, m_schema->simpleField.size() - 1);
+		}
+		break;
+
+	case Element::Placemark:
+		if (tag == KmlTag::Name)
+			return Element::PlacemarkName;
+		else if (tag == KmlTag::Style)
+		{
+			if (m_placemark->style)
+				delete m_placemark->style;
+			m_style = m_placemark->style = new InputStyle();
+			return Element::Style;
+		}
+		else if (tag == KmlTag::ExtendedData)
+		{
+			if (m_placemark->extendedData)
+				delete m_placemark->extendedData;
+			m_placemark->extendedData = new InputExtendedData();
+			return Element::ExtendedData;
+		}
+		else if (tag == KmlTag::Polygon)
+		{
+			m_polygon = new Polygon();
+			m_placemark->polygons.push_back(m_polygon);
+			return Element::Polygon;
+		}
+		else if (tag == KmlTag::MultiGeometry)
+			return Element::MultiGeometry;
+		else if (tag == KmlTag::LineString)
+		{
+			if (m_placemark->lineString)
+				delete m_placemark->lineString;
+			m_lineString = m_placemark->lineString = new LineString();
+			return Element::LineString;
+		}
+		else if (tag == KmlTag::TimeStamp)
+			return Element::TimeStamp;
+		break;
+
+	case Element::TimeStamp:
+		if (!parent.childFound && tag == KmlTag::When)
+		{
+			parent.childFound = true;
+			return Element::When;
+		}
+		break;
+
+	case Element::Style:
+		if (!m_style->lineStyle && tag == KmlTag::LineStyle)
+		{
+			m_style->lineStyle = new InputLineStyle();
+			return Element::LineStyle;
+		}
+		else if (!m_style->polyStyle && tag == KmlTag::PolyStyle)
+		{
+			m_style->polyStyle = new PolyStyle();
+			//the DOM constructor leaves fill empty if there is no fill element
+			m_style->polyStyle->fill = InternedString();
+			return Element::PolyStyle;
+		}
+		break;
+
+	case Element::LineStyle:
+		if (!parent.childFound && tag == KmlTag::Color)
+		{
+			parent.childFound = true;
+			return Element::Color;
+		}
+		break;
+
+	case Element::PolyStyle:
+		if (!parent.childFound && tag == KmlTag::Fill)
+		{
+			parent.childFound = true;
+			return Element::Fill;
+		}
+		break;
+
+	case Element::ExtendedData:
+		if (tag == KmlTag::SchemaData)
+		{
+			auto extendedData = m_placemark->extendedData;
+			if (extendedData->schemaData)
+				delete extendedData->schemaData;
+			m_schemaData = extendedData->schemaData = new InputSchemaData(&m_folder->data);
+			m_schemaData->schemaUrl = getAttribute(attrs, _X("schemaUrl"));
+			return Element::SchemaData;
+		}
+		break;
+
+	case Element::SchemaData:
+		if (tag == KmlTag::SimpleData)
+		{
+			//kept as Xerces text so reading each name doesn't allocate in the arena
+			auto name = attrs.getValue(_X("name"));
+			if (name)
+				m_dataName.assign(reinterpret_cast<const xerces_char*>(name));
+			else
+				m_dataName.clear();
+			return Element::SimpleData;
+		}
+		break;
 
-	//set the last modified time
-	zip_fileinfo zi = { 0 };
-	time_t rawTime;
-	time(&rawTime);
+	case Element::MultiGeometry:
+		//multigeometries can hold multiple polygons
+		if (tag == KmlTag::Polygon)
+		{
+			m_polygon = new Polygon();
+			m_placemark->polygons.push_back(m_polygon);
+			return Element::Polygon;
+		}
+		break;
 
-#ifdef _MSC_VER
-	struct tm gmt;
-	gmtime_s(&gmt, &rawTime);
-#else
-	struct tm gmt;
-	gmtime_r(&rawTime, &gmt);
-#endif
+	case Element::Polygon:
+		if (!m_polygon->outerBoundaryIs && tag == KmlTag::OuterBoundaryIs)
+		{
+			m_polygon->outerBoundaryIs = new OuterBoundaryIs();
+			return Element::OuterBoundaryIs;
+		}
+		break;
 
-	zi.tmz_date.tm_sec = gmt.tm_sec;
-	zi.tmz_date.tm_min = gmt.tm_min;
-	zi.tmz_date.tm_hour = gmt.tm_hour;
-	zi.tmz_date.tm_mday = gmt.tm_mday;
-	zi.tmz_date.tm_mon = gmt.tm_mon;
-	zi.tmz_date.tm_year = gmt.tm_year;
+	case Element::OuterBoundaryIs:
+		if (!m_polygon->outerBoundaryIs->linearRing && tag == KmlTag::LinearRing)
+		{
+			m_linearRing = m_polygon->outerBoundaryIs->linearRing = new LinearRing();
+			return Element::LinearRing;
+		}
+		break;
 
-#ifdef Z_DEFLATED
-	auto err = zipOpenNewFileInZip64(mcontext_, filename.c_str(),
-		&zi, nullptr, 0, nullptr, 0, nullptr, Z_DEFLATED, 9, dataLength > 0xffffffff);
-#else
-	auto err = zipOpenNewFileInZip(mcontext_, archiveName.c_str(),
-		&zi, nullptr, 0, nullptr, 0, nullptr, Z_BZIP2ED, 9);
-#endif
+	case Element::LinearRing:
+		if (!m_linearRing->coordinates && tag == KmlTag::Coordinates)
+		{
+			m_coordinates = m_linearRing->coordinates = new Coordinates();
+			return Element::Coordinates;
+		}
+		break;
 
-	if (err == ZIP_OK)
-	{
-		err = zipWriteInFileInZip(mcontext_, data, dataLength);
+	case Element::LineString:
+		if (!m_lineString->coordinates && tag == KmlTag::Coordinates)
+		{
+			m_coordinates = m_lineString->coordinates = new Coordinates();
+			return Element::Coordinates;
+		}
+		break;
 
-		//close the input and output files
-		zipCloseFileInZip(mcontext_);
+	default:
+		break;
 	}
 
-	//close the archive
-	zipClose(mcontext_, nullptr);
-
-	return err == ZIP_OK;
+	return Element::Ignore;
 }
 
-
-xercesc::DOMNode* findNode(xercesc::DOMNode* parent, const xerces_string& name)
+void KML::Internal::Input::InputKmlHandler::startElement(const XMLCh* const, const XMLCh* const, const XMLCh* const qname, const xercesc::Attributes& attrs)
 {
-	auto child = parent->getFirstChild();
-	while (child)
+	Element element;
+	if (m_stack.empty())
 	{
-		if (iequals(name, child->getNodeName()))
-			return child;
-		child = child->getNextSibling();
+		m_file->ns = getAttribute(attrs, _X("xmlns"));
+		element = Element::Kml;
 	}
-
-	return nullptr;
-}
-
-
-void Java::Internal::read_job_directory(const kmlFs::path& path, std::string& job_directory)
-{
-	if (kmlFs::exists(path))
+	else
 	{
-		XercesDOMParser mParser;
-		mParser.setValidationScheme(XercesDOMParser::Val_Never);
-		mParser.setDoNamespaces(false);
-		mParser.setDoSchema(false);
-		mParser.setLoadExternalDTD(false);
-#ifdef XERCES_USE_U
-		std::u16string str = path.u16string();
-#else
-		std::string str = path.string();
-#endif
-		mParser.parse(str.c_str());
-
-		xercesc::DOMDocument* dom = mParser.getDocument();
-		xercesc::DOMElement* map = dom->getDocumentElement();
-
-		xercesc::DOMNode* n1 = map->getFirstChild();
-		while (n1 != nullptr)
+		auto tag = lookupTag(qname);
+		//every coordinates element is located, even ignored ones, so the raw text stays in step with the parser
+		if (m_sourceCursor && tag == KmlTag::Coordinates)
 		{
-			if (iequals(n1->getNodeName(), _X("entry")))
-			{
-				xercesc::DOMElement* el = dynamic_cast<xercesc::DOMElement*>(n1);
-				if (el) {
-					xerces_string key = el->getAttribute(_X("key"));
-					if (iequals(key, _X("job_directory")))
-					{
-						xerces_string value = el->getAttribute(_X("value"));
-#ifdef XERCES_USE_U
-						job_directory = utf16_to_utf8(value);
-#else
-						job_directory = value;
-#endif
-						break;
-					}
-				}
-			}
-
-			n1 = n1->getNextSibling();
+			if (!findCoordinates(m_sourceCursor, m_sourceEnd, m_rawBegin, m_rawEnd))
+				m_rawBegin = m_rawEnd = nullptr;
 		}
+		element = childElement(m_stack.back(), tag, attrs);
 	}
-}
-
 
-KML::Internal::Input::InputKmlFile::InputKmlFile(kmlFs::path input)
-	: document(nullptr)
-{
-	initialize(input, "doc.kml");
-}
+	m_stack.push_back({ element, false });
 
-KML::Internal::Input::InputKmlFile::~InputKmlFile()
-{
-	if (document)
-		delete document;
+	switch (element)
+	{
+	case Element::DocumentName:
+	case Element::Href:
+	case Element::FolderName:
+	case Element::PlacemarkName:
+	case Element::When:
+	case Element::Color:
+	case Element::Fill:
+	case Element::SimpleData:
+	case Element::Coordinates:
+		//the text content of these elements is stored in the model
+		m_text.clear();
+		m_textDepth = m_stack.size();
+		break;
+	default:
+		break;
+	}
 }
 
-bool KML::Internal::Input::InputKmlFile::initialize(const kmlFs::path& input, const std::string& kmzPath)
+void KML::Internal::Input::InputKmlHandler::endElement(const XMLCh* const, const XMLCh* const, const XMLCh* const)
 {
-	if (kmlFs::exists(input))
+	if (m_stack.size() == m_textDepth)
 	{
-		XercesDOMParser mParser;
-		mParser.setValidationScheme(XercesDOMParser::Val_Never);
-		mParser.setDoNamespaces(false);
-		mParser.setDoSchema(false);
-		mParser.setLoadExternalDTD(false);
-#ifdef XERCES_USE_U
-		std::u16string str = input.u16string();
-#else
-		std::string str = input.string();
-#endif
-
-		if (boost::iequals(input.extension().string(), ".kmz"))
+		m_textDepth = 0;
+		switch (m_stack.back().element)
 		{
-			auto fileData = extractFile(input, kmzPath);
-			if (fileData.size())
+		case Element::DocumentName:
+			m_localName = xerces_to_kml(m_text);
+			break;
+		case Element::Href:
+			m_document->link = xerces_to_kml(m_text);
+			break;
+		case Element::FolderName:
+			m_folder->name = xerces_to_kml(m_text);
+			break;
+		case Element::PlacemarkName:
+			m_placemark->name = xerces_to_kml(m_text);
+			break;
+		case Element::When:
+			m_placemark->time = xerces_to_kml(m_text);
+			break;
+		case Element::Color:
+			m_style->lineStyle->color = intern(XercesTextView(m_text));
+			break;
+		case Element::Fill:
+			m_style->polyStyle->fill = intern(XercesTextView(m_text));
+			break;
+		case Element::SimpleData:
+			m_schemaData->setValue(XercesTextView(m_dataName), XercesTextView(m_text));
+			break;
+		case Element::Coordinates:
+			//the parsed text is still checked against the input in case an entity or comment changed it
+			if (m_rawBegin && matchesSource(m_text, m_rawBegin, m_rawEnd))
 			{
-				MemBufInputSource buf(&fileData[0], fileData.size(), (pathToString(input.filename()) + _X(" (in memory)")).c_str());
-				mParser.parse(buf);
+				m_coordinates->raw = m_rawBegin;
+				m_coordinates->rawLength = m_rawEnd - m_rawBegin;
 			}
 			else
-				throw kmlFs::filesystem_error("Invalid KMZ file", input, std::error_code());
-		}
-		else
-			mParser.parse(str.c_str());
-
-		xercesc::DOMDocument* dom = mParser.getDocument();
-		xercesc::DOMElement* kml = dom->getDocumentElement();
-
-		ns = kml->getAttribute(_X("xmlns"));
-
-		xercesc::DOMNode* n1 = kml->getFirstChild();
-		while (n1 != nullptr)
-		{
-			if (iequals(n1->getNodeName(), _X("Document")))
-			{
-				document = new InputDocument(n1);
-
-				if (document->link.size() > 0)
-				{
-					auto filename = document->link;
-					delete document;
-					document = nullptr;
-					ns.clear();
-
-					//skip the rest of the method
-					return initialize(input, utf16_to_utf8(filename));
-				}
-				break;
-			}
-
-			n1 = n1->getNextSibling();
-		}
-		if (document && document->folder)
-		{
-			for (int i = 0; i < document->folder->placemark.size() - 1; i++)
-				document->folder->placemark[i]->_next = document->folder->placemark[i + 1];
+				m_coordinates->value = xerces_to_kml(m_text);
+			m_rawBegin = m_rawEnd = nullptr;
+			break;
+		default:
+			break;
 		}
 	}
 
-	return document != nullptr;
+	m_stack.pop_back();
 }
 
-bool KML::Internal::Input::InputKmlFile::save(kmlFs::path output)
+void KML::Internal::Input::InputKmlHandler::characters(const XMLCh* const chars, const XMLSize_t length)
+{
+	if (m_textDepth)
+		m_text.append(chars, length);
+}
+
+bool KML::Internal::Input::InputKmlFile::save(kmlFs::path output, const KmlOutputOptions& options)
 {
 	bool isKmz = boost::iequals(output.extension().string(), ".kmz");
 	xercesc::DOMImplementation* impl = DOMImplementationRegistry::getDOMImplementation(_X("Core"));
 	if (impl != nullptr)
 	{
-		xercesc::DOMDocument* doc = impl->createDocument(0, _X("kml"), 0);
+		//the document, serializer, and output all allocate from one pool that is released when the file is written
+		PoolMemoryManager memoryManager;
+		XercesPtr<xercesc::DOMDocument> doc(impl->createDocument(0, _X("kml"), 0, &memoryManager));
 		xercesc::DOMElement* kml = doc->getDocumentElement();
 
 		if (document)
-			document->save(doc, kml);
+			document->save(doc.get(), kml);
 
 		xercesc::DOMImplementation *implementation = DOMImplementationRegistry::getDOMImplementation(_X("LS"));
 		// Create a DOMLSSerializer which is used to serialize a DOM tree into an XML document
-		xercesc::DOMLSSerializer *serializer = ((DOMImplementationLS*)implementation)->createLSSerializer();
-		//pretty print the exported xml
-		if (serializer->getDomConfig()->canSetParameter(XMLUni::fgDOMWRTFormatPrettyPrint, true))
-			serializer->getDomConfig()->setParameter(XMLUni::fgDOMWRTFormatPrettyPrint, true);
-		XMLFormatTarget* formatTarget;
+		XercesPtr<xercesc::DOMLSSerializer> serializer(((DOMImplementationLS*)implementation)->createLSSerializer(&memoryManager));
+		//pretty print the exported xml unless compact output was asked for
+		if (serializer->getDomConfig()->canSetParameter(XMLUni::fgDOMWRTFormatPrettyPrint, options.prettyPrint))
+			serializer->getDomConfig()->setParameter(XMLUni::fgDOMWRTFormatPrettyPrint, options.prettyPrint);
+		//the target is closed, and any compression threads stopped, even if serializing throws
+		std::unique_ptr<XMLFormatTarget> formatTarget;
+		ZipFormatTarget* zipTarget = nullptr;
 		// Specify the target for the XML output
 		if (isKmz)
 		{
-			//for KMZ build the output file in memory
-			formatTarget = new MemBufFormatTarget();
+			//for KMZ compress the output as it is written
+			formatTarget.reset(zipTarget = new ZipFormatTarget(output, "doc.kml", options.compressionLevel, options.compressionThreads));
 		}
 		else
 		{
 #ifdef XERCES_USE_U
-			formatTarget = new LocalFileFormatTarget(output.u16string().c_str());
+			formatTarget.reset(new LocalFileFormatTarget(output.u16string().c_str(), &memoryManager));
 #else
-			formatTarget = new LocalFileFormatTarget(output.c_str());
+			formatTarget.reset(new LocalFileFormatTarget(output.c_str(), &memoryManager));
 #endif
 		}
 		// Create a new empty output destination object
-		xercesc::DOMLSOutput *domout = ((DOMImplementationLS*)implementation)->createLSOutput();
+		XercesPtr<xercesc::DOMLSOutput> domout(((DOMImplementationLS*)implementation)->createLSOutput(&memoryManager));
 		// Set the stream to our target
-		domout->setByteStream(formatTarget);
+		domout->setByteStream(formatTarget.get());
 		// Write the serialized output to the destination
-		serializer->write(doc, domout);
-
-		//write the KMZ file
-		if (isKmz)
-		{
-			auto target = static_cast<MemBufFormatTarget*>(formatTarget);
-			createZipFile(output, "doc.kml", target->getRawBuffer(), target->getLen());
-		}
+		serializer->write(doc.get(), domout.get());
 
-		serializer->release();
-		delete formatTarget;
-		domout->release();
+		//finish writing the KMZ file
+		bool success = true;
+		if (zipTarget)
+			success = zipTarget->finish();
 
-		doc->release();
-		
-		return true;
+		//the serializer, output, and document are released when they go out of scope, even if writing throws
+		return success;
 	}
 	
 	return false;
 }
 
 KML::Internal::Output::OutputKmlFile::OutputKmlFile(const KML::Internal::Input::InputKmlFile* input, const HSS_Time::WTimeSpan& offset)
+	: document(nullptr),
+	  m_arena(new ModelArena(input->arena()))
 {
-	ns = input->ns;
-	if (input->document)
-		document = new OutputDocument(input->document, offset);
+	try
+	{
+		ns = input->ns;
+		if (input->document)
+		{
+			ModelArena::Scope scope(m_arena);
+			document = new OutputDocument(input->document);
+		}
+		applyOffset(input, offset);
+	}
+	catch (...)
+	{
+		if (document)
+			delete document;
+		delete m_arena;
+		throw;
+	}
 }
 
-bool KML::Internal::Output::OutputKmlFile::save(kmlFs::path output)
+KML::Internal::Output::OutputKmlFile::~OutputKmlFile()
 {
-	bool isKmz = boost::iequals(output.extension().string(), ".kmz");
-	xercesc::DOMImplementation* impl = DOMImplementationRegistry::getDOMImplementation(_X("Core"));
-	if (impl != nullptr)
-	{
-		xercesc::DOMDocument* doc = impl->createDocument(0, _X("kml"), 0);
-		xercesc::DOMElement* kml = doc->getDocumentElement();
-
-		if (ns.length() > 0)
-			kml->setAttribute(_X("xmlns"), ns.c_str());
+	//the destructors free anything that was allocated on the heap, the arena's blocks go after
+	if (document)
+		delete document;
+	delete m_arena;
+}
 
-		if (document)
-			document->save(doc, kml);
+void KML::Internal::Output::OutputKmlFile::applyOffset(const KML::Internal::Input::InputKmlFile* input, const HSS_Time::WTimeSpan& offset)
+{
+	if (document)
+	{
+		//the context and the times it caches are temporary, only the time spans go in the arena
+		ModelArena::Scope heap(nullptr);
+		OutputTimeContext context(offset);
+		ModelArena::Scope scope(m_arena);
+		document->applyOffset(input->document, context);
+	}
+}
 
-		xercesc::DOMImplementation* implementation = DOMImplementationRegistry::getDOMImplementation(_X("LS"));
-		// Create a DOMLSSerializer which is used to serialize a DOM tree into an XML document
-		xercesc::DOMLSSerializer* serializer = ((DOMImplementationLS*)implementation)->createLSSerializer();
-		//pretty print the exported xml
-		if (serializer->getDomConfig()->canSetParameter(XMLUni::fgDOMWRTFormatPrettyPrint, true))
-			serializer->getDomConfig()->setParameter(XMLUni::fgDOMWRTFormatPrettyPrint, true);
-		XMLFormatTarget* formatTarget;
-		// Specify the target for the XML output
-		if (isKmz)
-		{
-			//for KMZ build the output file in memory
-			formatTarget = new MemBufFormatTarget();
-		}
-		else
-		{
+bool KML::Internal::Output::OutputKmlFile::save(kmlFs::path output, const KmlOutputOptions& options, KmlOutputFormat format) const
+{
+	bool isKmz;
+	if (format == KmlOutputFormat::Auto)
+		isKmz = boost::iequals(output.extension().string(), ".kmz");
+	else
+		isKmz = format == KmlOutputFormat::Kmz;
+	//the target is closed, and any compression threads stopped, even if writing throws
+	std::unique_ptr<XMLFormatTarget> formatTarget;
+	ZipFormatTarget* zipTarget = nullptr;
+	// Specify the target for the XML output
+	if (isKmz)
+	{
+		//for KMZ compress the output as it is written
+		formatTarget.reset(zipTarget = new ZipFormatTarget(output, "doc.kml", options.compressionLevel, options.compressionThreads));
+	}
+	else
+	{
 #ifdef XERCES_USE_U
-			formatTarget = new LocalFileFormatTarget(output.u16string().c_str());
+		formatTarget.reset(new LocalFileFormatTarget(output.u16string().c_str()));
 #else
-			formatTarget = new LocalFileFormatTarget(output.c_str());
+		formatTarget.reset(new LocalFileFormatTarget(output.c_str()));
 #endif
-		}
-		// Create a new empty output destination object
-		xercesc::DOMLSOutput *domout = ((DOMImplementationLS*)implementation)->createLSOutput();
-		// Set the stream to our target
-		domout->setByteStream(formatTarget);
-		// Write the serialized output to the destination
-		serializer->write(doc, domout);
+	}
 
-		//write the KMZ file
-		if (isKmz)
-		{
-			auto target = static_cast<MemBufFormatTarget*>(formatTarget);
-			createZipFile(output, "doc.kml", target->getRawBuffer(), target->getLen());
-		}
+	{
+		//write the document straight to the target, no DOM is built for the output
+		KmlWriter writer(formatTarget.get(), options.prettyPrint, options.normalizeCoordinates, options.coordinatePrecision);
+		writer.startDocument();
+		writer.startElement(_X("kml"));
 
-		serializer->release();
-		delete formatTarget;
-		domout->release();
+		if (ns.length() > 0)
+			writer.attribute(_X("xmlns"), ns);
 
-		doc->release();
+		if (document)
+			document->write(writer, options.sharedStyles);
 
-		return true;
+		writer.endElement();
+		writer.endDocument();
 	}
 
-	return false;
+	//finish writing the KMZ file
+	bool success = true;
+	if (zipTarget)
+		success = zipTarget->finish();
+
+	return success;
 }
 
 KML::Internal::Input::InputDocument::InputDocument(xercesc::DOMNode * elem)
 	: schema(nullptr),
 	  folder(nullptr)
 {
-	xercesc::DOMElement* el = dynamic_cast<DOMElement*>(elem);
-	xerces_string localName = _X("Data");
+	xercesc::DOMElement* el = asElement(elem);
+	kml_string localName = _K("Data");
 	if (el != nullptr)
 	{
-		id = el->getAttribute(_X("id"));
+		id = xerces_to_kml(el->getAttribute(_X("id")));
 
-		xercesc::DOMNode* node = el->getFirstChild();
-		while (node != nullptr)
+		for (auto child : ElementChildren(el))
 		{
-			xerces_string name = node->getNodeName();
-
-			if (!schema && iequals(name, _X("Schema")))
-				schema = new InputSchema(node);
-			else if (!folder && (iequals(name, _X("Folder")) || iequals(name, _X("Document"))))
-				folder = new InputFolder(node);
-			//the placemarks aren't in a folder they are direclty in the document
-			else if (iequals(name, _X("Placemark")))
+			switch (child.tag)
 			{
+			case KmlTag::Schema:
+				if (!schema)
+					schema = new InputSchema(child.element);
+				break;
+			case KmlTag::Folder:
+			case KmlTag::Document:
 				if (!folder)
+					folder = new InputFolder(child.element);
+				break;
+			//the placemarks aren't in a folder they are directly in the document
+			case KmlTag::Placemark:
+				if (!folder)
+				{
 					folder = new InputFolder(localName);
-				folder->parsePlacemark(node);
-			}
-			else if (iequals(name, _X("name")))
-				localName = node->getTextContent();
-			else if (link.size() == 0 && iequals(name, _X("NetworkLink")))
-			{
-				xercesc::DOMNode* _link = findNode(node, _X("Link"));
-				if (_link)
+					if (schema)
+						folder->data.addFields(schema);
+				}
+				folder->parsePlacemark(child.element);
+				break;
+			case KmlTag::Name:
+				localName = xerces_to_kml(child.element->getTextContent());
+				break;
+			case KmlTag::NetworkLink:
+				if (link.size() == 0)
 				{
-					xercesc::DOMElement* href = dynamic_cast<xercesc::DOMElement*>(findNode(_link, _X("href")));
-					if (href)
-						this->link = href->getTextContent();
+					auto _link = ElementChildren(child.element).find(KmlTag::Link);
+					if (_link)
+					{
+						auto href = ElementChildren(_link).find(KmlTag::Href);
+						if (href)
+							this->link = xerces_to_kml(href->getTextContent());
+					}
 				}
+				break;
+			default:
+				break;
 			}
-
-			node = node->getNextSibling();
 		}
 	}
 }
 
+KML::Internal::Input::InputDocument::InputDocument()
+	: folder(nullptr),
+	  schema(nullptr)
+{
+}
+
 KML::Internal::Input::InputDocument::~InputDocument()
 {
 	if (schema)
@@ -584,7 +2652,7 @@ void KML::Internal::Input::InputDocument::save(xercesc::DOMDocument* document, x
 	xercesc::DOMElement* element = document->createElement(_X("Document"));
 	parent->appendChild(element);
 	
-	element->setAttribute(_X("id"), id.c_str());
+	element->setAttribute(_X("id"), kml_to_xerces(id).c_str());
 
 	if (schema)
 		schema->save(document, element);
@@ -595,25 +2663,35 @@ void KML::Internal::Input::InputDocument::save(xercesc::DOMDocument* document, x
 KML::Internal::Input::InputFolder::InputFolder(xercesc::DOMNode * elem)
 	: schema(nullptr)
 {
-	xercesc::DOMElement* el = dynamic_cast<xercesc::DOMElement*>(elem);
+	xercesc::DOMElement* el = asElement(elem);
 	if (el != nullptr)
 	{
-		xercesc::DOMNode* node = el->getFirstChild();
-		while (node != nullptr)
+		for (auto child : ElementChildren(el))
 		{
-			if (name.length() == 0 && iequals(node->getNodeName(), _X("name")))
-				name = node->getTextContent();
-			else if (!schema && iequals(node->getNodeName(), _X("Schema")))
-				schema = new InputSchema(node);
-			else if (iequals(node->getNodeName(), _X("PlaceMark")))
-				parsePlacemark(node);
-
-			node = node->getNextSibling();
+			switch (child.tag)
+			{
+			case KmlTag::Name:
+				if (name.length() == 0)
+					name = xerces_to_kml(child.element->getTextContent());
+				break;
+			case KmlTag::Schema:
+				if (!schema)
+				{
+					schema = new InputSchema(child.element);
+					data.addFields(schema);
+				}
+				break;
+			case KmlTag::Placemark:
+				parsePlacemark(child.element);
+				break;
+			default:
+				break;
+			}
 		}
 	}
 }
 
-KML::Internal::Input::InputFolder::InputFolder(const xerces_string& name)
+KML::Internal::Input::InputFolder::InputFolder(const kml_string& name)
 	: name(name),
 	  schema(nullptr)
 {
@@ -630,7 +2708,7 @@ KML::Internal::Input::InputFolder::~InputFolder()
 
 void KML::Internal::Input::InputFolder::parsePlacemark(xercesc::DOMNode* node)
 {
-	placemark.push_back(new InputPlacemark(node));
+	placemark.push_back(new InputPlacemark(node, &data));
 }
 
 void KML::Internal::Input::InputFolder::save(xercesc::DOMDocument* document, xercesc::DOMElement* parent)
@@ -639,7 +2717,7 @@ void KML::Internal::Input::InputFolder::save(xercesc::DOMDocument* document, xer
 	parent->appendChild(element);
 
 	xercesc::DOMElement* nameElement = document->createElement(_X("name"));
-	nameElement->setTextContent(name.c_str());
+	nameElement->setTextContent(kml_to_xerces(name).c_str());
 	element->appendChild(nameElement);
 	
 	if (schema)
@@ -650,23 +2728,24 @@ void KML::Internal::Input::InputFolder::save(xercesc::DOMDocument* document, xer
 
 KML::Internal::Input::InputSchema::InputSchema(xercesc::DOMNode * elem)
 {
-	xercesc::DOMElement* el = dynamic_cast<DOMElement*>(elem);
+	xercesc::DOMElement* el = asElement(elem);
 	if (el != nullptr)
 	{
-		id = el->getAttribute(_X("id"));
-		name = el->getAttribute(_X("name"));
+		id = xerces_to_kml(el->getAttribute(_X("id")));
+		name = xerces_to_kml(el->getAttribute(_X("name")));
 
-		DOMNode* node = el->getFirstChild();
-		while (node != nullptr)
+		for (auto child : ElementChildren(el))
 		{
-			if (iequals(node->getNodeName(), _X("SimpleField")))
-				simpleField.push_back(new SimpleField(node));
-
-			node = node->getNextSibling();
+			if (child.tag == KmlTag::SimpleField)
+				simpleField.push_back(new SimpleField(child.element));
 		}
 	}
 }
 
+KML::Internal::Input::InputSchema::InputSchema()
+{
+}
+
 KML::Internal::Input::InputSchema::~InputSchema()
 {
 	for (auto it = simpleField.begin(); it != simpleField.end(); it++)
@@ -679,58 +2758,78 @@ void KML::Internal::Input::InputSchema::save(xercesc::DOMDocument* document, xer
 	xercesc::DOMElement* element = document->createElement(_X("Schema"));
 	parent->appendChild(element);
 
-	element->setAttribute(_X("name"), name.c_str());
-	element->setAttribute(_X("id"), id.c_str());
+	element->setAttribute(_X("name"), kml_to_xerces(name).c_str());
+	element->setAttribute(_X("id"), kml_to_xerces(id).c_str());
 
 	for (auto it = simpleField.begin(); it != simpleField.end(); it++)
 		(*it)->save(document, element);
 }
 
-KML::Internal::Input::InputPlacemark::InputPlacemark(xercesc::DOMNode * elem)
+KML::Internal::Input::InputPlacemark::InputPlacemark(xercesc::DOMNode * elem, InputDataTable* table)
 	: style(nullptr),
 	  extendedData(nullptr),
-	  lineString(nullptr),
-      _next(nullptr)
+	  lineString(nullptr)
 {
-	xercesc::DOMElement* el = dynamic_cast<xercesc::DOMElement*>(elem);
+	xercesc::DOMElement* el = asElement(elem);
 	if (el != nullptr)
 	{
-		DOMNode* node = el->getFirstChild();
-		while (node != nullptr)
-		{
-			if (iequals(node->getNodeName(), _X("name")))
-				name = node->getTextContent();
-			else if (iequals(node->getNodeName(), _X("Style")))
-				style = new InputStyle(node);
-			else if (iequals(node->getNodeName(), _X("ExtendedData")))
-				extendedData = new InputExtendedData(node);
-			else if (iequals(node->getNodeName(), _X("Polygon")))
-				polygons.push_back(new Polygon(node));
-			else if (iequals(node->getNodeName(), _X("MultiGeometry")))
+		for (auto child : ElementChildren(el))
+		{
+			switch (child.tag)
+			{
+			case KmlTag::Name:
+				name = xerces_to_kml(child.element->getTextContent());
+				break;
+			//the last of each element is used, the ones before it are released
+			case KmlTag::Style:
+				if (style)
+					delete style;
+				style = new InputStyle(child.element);
+				break;
+			case KmlTag::ExtendedData:
+				if (extendedData)
+					delete extendedData;
+				extendedData = new InputExtendedData(child.element, table);
+				break;
+			case KmlTag::Polygon:
+				polygons.push_back(new Polygon(child.element));
+				break;
+			case KmlTag::MultiGeometry:
 			{
 				//multigeometries can hold multiple polygons
-				DOMNode* inode = node->getFirstChild();
-				while (inode != nullptr)
+				for (auto inode : ElementChildren(child.element))
 				{
-					if (iequals(inode->getNodeName(), _X("Polygon")))
-						polygons.push_back(new Polygon(inode));
-					inode = inode->getNextSibling();
+					if (inode.tag == KmlTag::Polygon)
+						polygons.push_back(new Polygon(inode.element));
 				}
+				break;
 			}
-			else if (iequals(node->getNodeName(), _X("LineString")))
-				lineString = new LineString(node);
-			else if (iequals(node->getNodeName(), _X("TimeStamp")))
+			case KmlTag::LineString:
+				if (lineString)
+					delete lineString;
+				lineString = new LineString(child.element);
+				break;
+			case KmlTag::TimeStamp:
 			{
-				auto when = findNode(node, _X("when"));
+				auto when = ElementChildren(child.element).find(KmlTag::When);
 				if (when)
-					time = when->getTextContent();
+					time = xerces_to_kml(when->getTextContent());
+				break;
+			}
+			default:
+				break;
 			}
-
-			node = node->getNextSibling();
 		}
 	}
 }
 
+KML::Internal::Input::InputPlacemark::InputPlacemark()
+	: style(nullptr),
+	  extendedData(nullptr),
+	  lineString(nullptr)
+{
+}
+
 KML::Internal::Input::InputPlacemark::~InputPlacemark()
 {
 	if (style)
@@ -750,7 +2849,7 @@ void KML::Internal::Input::InputPlacemark::save(xercesc::DOMDocument* document,
 	parent->appendChild(element);
 
 	xercesc::DOMElement* nameElement = document->createElement(_X("name"));
-	nameElement->setTextContent(name.c_str());
+	nameElement->setTextContent(kml_to_xerces(name).c_str());
 	element->appendChild(nameElement);
 
 	if (style)
@@ -761,70 +2860,199 @@ void KML::Internal::Input::InputPlacemark::save(xercesc::DOMDocument* document,
 		polygons[0]->save(document, element);
 	else if (polygons.size() > 1)
 	{
-		xercesc::DOMElement* multiElement = document->createElement(_X("MultiGeometry"));
-		element->appendChild(multiElement);
-		for (auto p : polygons)
-			p->save(document, multiElement);
+		xercesc::DOMElement* multiElement = document->createElement(_X("MultiGeometry"));
+		element->appendChild(multiElement);
+		for (auto p : polygons)
+			p->save(document, multiElement);
+	}
+	if (lineString)
+		lineString->save(document, element);
+}
+
+KML::Internal::Input::InputExtendedData::InputExtendedData(xercesc::DOMNode * elem, InputDataTable* table)
+	: schemaData(nullptr)
+{
+	xercesc::DOMElement* el = asElement(elem);
+	if (el != nullptr)
+	{
+		for (auto child : ElementChildren(el))
+		{
+			if (child.tag == KmlTag::SchemaData)
+			{
+				if (schemaData)
+					delete schemaData;
+				schemaData = new InputSchemaData(child.element, table);
+			}
+		}
+	}
+}
+
+KML::Internal::Input::InputExtendedData::InputExtendedData()
+	: schemaData(nullptr)
+{
+}
+
+KML::Internal::Input::InputExtendedData::~InputExtendedData()
+{
+	if (schemaData)
+		delete schemaData;
+}
+
+void KML::Internal::Input::InputExtendedData::save(xercesc::DOMDocument* document, xercesc::DOMElement* parent)
+{
+	xercesc::DOMElement* element = document->createElement(_X("ExtendedData"));
+	parent->appendChild(element);
+
+	if (schemaData)
+		schemaData->save(document, element);
+}
+
+KML::Internal::Input::InputDataTable::InputDataTable()
+	: m_rows(0)
+{
+}
+
+void KML::Internal::Input::InputDataTable::addFields(const InputSchema* schema)
+{
+	for (std::size_t i = 0; i < schema->simpleField.size(); i++)
+		column(schema->simpleField[i]->name, i);
+}
+
+std::uint32_t KML::Internal::Input::InputDataTable::column(kml_string_view name, std::size_t hint)
+{
+	if (hint < columns.size() && columns[hint].name == name)
+		return static_cast<std::uint32_t>(hint);
+	for (std::size_t i = 0; i < columns.size(); i++)
+	{
+		if (columns[i].name == name)
+			return static_cast<std::uint32_t>(i);
 	}
-	if (lineString)
-		lineString->save(document, element);
+
+	//the fields used by the output are recognized in any case
+	auto role = Role::None;
+	if (iequals(name, _K("WIDTH")))
+		role = Role::Width;
+	else if (iequals(name, _K("COLOR")))
+		role = Role::Color;
+	else if (iequals(name, _K("TIMESTAMP")))
+		role = Role::Timestamp;
+
+	auto index = static_cast<std::uint32_t>(columns.size());
+	columns.emplace_back();
+	columns.back().name = name;
+	columns.back().role = role;
+	return index;
 }
 
-KML::Internal::Input::InputExtendedData::InputExtendedData(xercesc::DOMNode * elem)
-	: schemaData(nullptr)
+std::uint32_t KML::Internal::Input::InputDataTable::duplicate(std::uint32_t column)
 {
-	xercesc::DOMElement* el = dynamic_cast<DOMElement*>(elem);
-	if (el != nullptr)
+	for (std::size_t i = column + 1; i < columns.size(); i++)
 	{
-		xercesc::DOMNode* node = el->getFirstChild();
-		while (node != nullptr)
-		{
-			if (iequals(node->getNodeName(), _X("SchemaData")))
-				schemaData = new InputSchemaData(node);
+		if (columns[i].name == columns[column].name)
+			return static_cast<std::uint32_t>(i);
+	}
 
-			node = node->getNextSibling();
-		}
+	auto index = static_cast<std::uint32_t>(columns.size());
+	columns.emplace_back();
+	columns.back().name = columns[column].name;
+	columns.back().role = columns[column].role;
+	return index;
+}
+
+bool KML::Internal::Input::InputDataTable::set(std::size_t row, std::uint32_t column, kml_string_view value)
+{
+	auto& c = columns[column];
+	if (c.present.size() <= row)
+	{
+		c.present.resize(row + 1);
+		c.values.resize(row + 1);
 	}
+	else if (c.present[row])
+		return false;
+
+	c.present[row] = true;
+	c.values[row] = intern(value);
+	return true;
 }
 
-KML::Internal::Input::InputExtendedData::~InputExtendedData()
+const InternedString* KML::Internal::Input::InputDataTable::value(std::size_t row, std::uint32_t column) const
 {
-	if (schemaData)
-		delete schemaData;
+	if (column == npos)
+		return nullptr;
+	auto& c = columns[column];
+	if (row < c.present.size() && c.present[row])
+		return &c.values[row];
+	return nullptr;
 }
 
-void KML::Internal::Input::InputExtendedData::save(xercesc::DOMDocument* document, xercesc::DOMElement* parent)
+void KML::Internal::Input::InputDataTable::save(xercesc::DOMDocument* document, xercesc::DOMElement* parent, std::size_t row, std::uint32_t column) const
 {
-	xercesc::DOMElement* element = document->createElement(_X("ExtendedData"));
+	xercesc::DOMElement* element = document->createElement(_X("SimpleData"));
 	parent->appendChild(element);
 
-	if (schemaData)
-		schemaData->save(document, element);
+	element->setAttribute(_X("name"), kml_to_xerces(columns[column].name).c_str());
+	element->setTextContent(kml_to_xerces(columns[column].values[row]).c_str());
+}
+
+void KML::Internal::Input::InputDataTable::write(KmlWriter& writer, std::size_t row, std::uint32_t column) const
+{
+	writer.startElement(_X("SimpleData"));
+	writer.attribute(_X("name"), columns[column].name);
+	writer.text(columns[column].values[row]);
+	writer.endElement();
 }
 
-KML::Internal::Input::InputSchemaData::InputSchemaData(xercesc::DOMNode * elem)
+KML::Internal::Input::InputSchemaData::InputSchemaData(xercesc::DOMNode * elem, InputDataTable* table)
+	: table(table),
+	  row(table->addRow())
 {
-	xercesc::DOMElement* el = dynamic_cast<xercesc::DOMElement*>(elem);
+	xercesc::DOMElement* el = asElement(elem);
 	if (el != nullptr)
 	{
-		schemaUrl = el->getAttribute(_X("schemaUrl"));
+		schemaUrl = xerces_to_kml(el->getAttribute(_X("schemaUrl")));
 
-		xercesc::DOMNode* node = el->getFirstChild();
-		while (node != nullptr)
+		for (auto child : ElementChildren(el))
 		{
-			if (iequals(node->getNodeName(), _X("SimpleData")))
-				simpleData.push_back(new SimpleData(node));
-
-			node = node->getNextSibling();
+			if (child.tag == KmlTag::SimpleData)
+				setValue(XercesTextView(child.element->getAttribute(_X("name"))), XercesTextView(child.element->getTextContent()));
 		}
 	}
 }
 
-KML::Internal::Input::InputSchemaData::~InputSchemaData()
+KML::Internal::Input::InputSchemaData::InputSchemaData(InputDataTable* table)
+	: table(table),
+	  row(table->addRow())
 {
-	for (auto it = simpleData.begin(); it != simpleData.end(); it++)
-		delete *it;
-	simpleData.clear();
+}
+
+void KML::Internal::Input::InputSchemaData::setValue(kml_string_view name, kml_string_view value)
+{
+	//the values are normally in the same order in every placemark so the next column is tried first
+	auto column = table->column(name, columns.size());
+	while (!table->set(row, column, value))
+		column = table->duplicate(column);
+	columns.push_back(column);
+}
+
+const InternedString* KML::Internal::Input::InputSchemaData::value(InputDataTable::Role role) const
+{
+	if (role == InputDataTable::Role::Timestamp)
+	{
+		for (auto it = columns.begin(); it != columns.end(); it++)
+		{
+			if (table->columns[*it].role == role)
+				return table->value(row, *it);
+		}
+	}
+	else
+	{
+		for (auto it = columns.rbegin(); it != columns.rend(); it++)
+		{
+			if (table->columns[*it].role == role)
+				return table->value(row, *it);
+		}
+	}
+	return nullptr;
 }
 
 void KML::Internal::Input::InputSchemaData::save(xercesc::DOMDocument* document, xercesc::DOMElement* parent)
@@ -833,32 +3061,35 @@ void KML::Internal::Input::InputSchemaData::save(xercesc::DOMDocument* document,
 	parent->appendChild(element);
 
 	if (schemaUrl.length() > 0)
-		element->setAttribute(_X("schemaUrl"), schemaUrl.c_str());
+		element->setAttribute(_X("schemaUrl"), kml_to_xerces(schemaUrl).c_str());
 
-	for (auto it = simpleData.begin(); it != simpleData.end(); it++)
-		(*it)->save(document, element);
+	for (auto it = columns.begin(); it != columns.end(); it++)
+		table->save(document, element, row, *it);
 }
 
 KML::Internal::Input::InputStyle::InputStyle(xercesc::DOMNode * elem)
 	: lineStyle(nullptr),
 	  polyStyle(nullptr)
 {
-	xercesc::DOMElement* el = dynamic_cast<xercesc::DOMElement*>(elem);
+	xercesc::DOMElement* el = asElement(elem);
 	if (el != nullptr)
 	{
-		DOMNode* node = el->getFirstChild();
-		while (node != nullptr)
+		for (auto child : ElementChildren(el))
 		{
-			if (!lineStyle && iequals(node->getNodeName(), _X("LineStyle")))
-				lineStyle = new InputLineStyle(node);
-			else if (!polyStyle && iequals(node->getNodeName(), _X("PolyStyle")))
-				polyStyle = new PolyStyle(node);
-
-			node = node->getNextSibling();
+			if (!lineStyle && child.tag == KmlTag::LineStyle)
+				lineStyle = new InputLineStyle(child.element);
+			else if (!polyStyle && child.tag == KmlTag::PolyStyle)
+				polyStyle = new PolyStyle(child.element);
 		}
 	}
 }
 
+KML::Internal::Input::InputStyle::InputStyle()
+	: lineStyle(nullptr),
+	  polyStyle(nullptr)
+{
+}
+
 KML::Internal::Input::InputStyle::~InputStyle()
 {
 	if (lineStyle)
@@ -880,23 +3111,24 @@ void KML::Internal::Input::InputStyle::save(xercesc::DOMDocument* document, xerc
 
 KML::Internal::Input::InputLineStyle::InputLineStyle(xercesc::DOMNode * elem)
 {
-	xercesc::DOMElement* el = dynamic_cast<DOMElement*>(elem);
+	xercesc::DOMElement* el = asElement(elem);
 	if (el != nullptr)
 	{
-		DOMNode* node = el->getFirstChild();
-		while (node != nullptr)
+		for (auto child : ElementChildren(el))
 		{
-			if (iequals(node->getNodeName(), _X("color")))
+			if (child.tag == KmlTag::Color)
 			{
-				color = node->getTextContent();
+				color = intern(XercesTextView(child.element->getTextContent()));
 				break;
 			}
-
-			node = node->getNextSibling();
 		}
 	}
 }
 
+KML::Internal::Input::InputLineStyle::InputLineStyle()
+{
+}
+
 void KML::Internal::Input::InputLineStyle::save(xercesc::DOMDocument* document, xercesc::DOMElement* parent)
 {
 	xercesc::DOMElement* element = document->createElement(_X("LineStyle"));
@@ -904,19 +3136,23 @@ void KML::Internal::Input::InputLineStyle::save(xercesc::DOMDocument* document,
 
 	xercesc::DOMElement* colorElement = document->createElement(_X("color"));
 	element->appendChild(colorElement);
-	colorElement->setTextContent(color.c_str());
+	colorElement->setTextContent(kml_to_xerces(color).c_str());
 }
 
 KML::Internal::SimpleField::SimpleField(xercesc::DOMNode * elem)
 {
-	xercesc::DOMElement* el = dynamic_cast<DOMElement*>(elem);
+	xercesc::DOMElement* el = asElement(elem);
 	if (el != nullptr)
 	{
-		name = el->getAttribute(_X("name"));
-		type = el->getAttribute(_X("type"));
+		name = xerces_to_kml(el->getAttribute(_X("name")));
+		type = intern(XercesTextView(el->getAttribute(_X("type"))));
 	}
 }
 
+KML::Internal::SimpleField::SimpleField()
+{
+}
+
 KML::Internal::SimpleField::SimpleField(const SimpleField& other)
 {
 	name = other.name;
@@ -928,57 +3164,37 @@ void KML::Internal::SimpleField::save(xercesc::DOMDocument* document, xercesc::D
 	xercesc::DOMElement* element = document->createElement(_X("SimpleField"));
 	parent->appendChild(element);
 
-	element->setAttribute(_X("name"), name.c_str());
-	element->setAttribute(_X("type"), type.c_str());
-}
-
-KML::Internal::SimpleData::SimpleData(xercesc::DOMNode * elem)
-{
-	xercesc::DOMElement* el = dynamic_cast<xercesc::DOMElement*>(elem);
-	if (el != nullptr)
-	{
-		name = el->getAttribute(_X("name"));
-		value = el->getTextContent();
-	}
-}
-
-KML::Internal::SimpleData::SimpleData(const SimpleData& other)
-{
-	name = other.name;
-	value = other.value;
+	element->setAttribute(_X("name"), kml_to_xerces(name).c_str());
+	element->setAttribute(_X("type"), kml_to_xerces(type).c_str());
 }
 
-void KML::Internal::SimpleData::save(xercesc::DOMDocument* document, xercesc::DOMElement* parent)
+void KML::Internal::SimpleField::write(KmlWriter& writer) const
 {
-	xercesc::DOMElement* element = document->createElement(_X("SimpleData"));
-	parent->appendChild(element);
-
-	element->setAttribute(_X("name"), name.c_str());
-	element->setTextContent(value.c_str());
+	writer.startElement(_X("SimpleField"));
+	writer.attribute(_X("name"), name);
+	writer.attribute(_X("type"), type);
+	writer.endElement();
 }
 
 KML::Internal::PolyStyle::PolyStyle(xercesc::DOMNode * elem)
 {
-	xercesc::DOMElement* el = dynamic_cast<xercesc::DOMElement*>(elem);
+	xercesc::DOMElement* el = asElement(elem);
 	if (el != nullptr)
 	{
-		DOMNode* node = el->getFirstChild();
-		while (node != nullptr)
+		for (auto child : ElementChildren(el))
 		{
-			if (iequals(node->getNodeName(), _X("fill")))
+			if (child.tag == KmlTag::Fill)
 			{
-				fill = node->getTextContent();
+				fill = intern(XercesTextView(child.element->getTextContent()));
 				break;
 			}
-
-			node = node->getNextSibling();
 		}
 	}
 }
 
 KML::Internal::PolyStyle::PolyStyle()
 {
-	fill = _X("0");
+	fill = intern(_K("0"));
 }
 
 KML::Internal::PolyStyle::PolyStyle(const PolyStyle& other)
@@ -993,26 +3209,35 @@ void KML::Internal::PolyStyle::save(xercesc::DOMDocument* document, xercesc::DOM
 
 	xercesc::DOMElement* fillElement = document->createElement(_X("fill"));
 	element->appendChild(fillElement);
-	fillElement->setTextContent(fill.c_str());
+	fillElement->setTextContent(kml_to_xerces(fill).c_str());
+}
+
+void KML::Internal::PolyStyle::write(KmlWriter& writer) const
+{
+	writer.startElement(_X("PolyStyle"));
+	writer.textElement(_X("fill"), fill);
+	writer.endElement();
 }
 
 KML::Internal::Polygon::Polygon(xercesc::DOMNode * elem)
     : outerBoundaryIs(nullptr)
 {
-	xercesc::DOMElement* el = dynamic_cast<xercesc::DOMElement*>(elem);
+	xercesc::DOMElement* el = asElement(elem);
 	if (el != nullptr)
 	{
-		DOMNode* node = el->getFirstChild();
-		while (node != nullptr)
+		for (auto child : ElementChildren(el))
 		{
-			if (!outerBoundaryIs && iequals(node->getNodeName(), _X("outerBoundaryIs")))
-				outerBoundaryIs = new OuterBoundaryIs(node);
-
-			node = node->getNextSibling();
+			if (!outerBoundaryIs && child.tag == KmlTag::OuterBoundaryIs)
+				outerBoundaryIs = new OuterBoundaryIs(child.element);
 		}
 	}
 }
 
+KML::Internal::Polygon::Polygon()
+	: outerBoundaryIs(nullptr)
+{
+}
+
 KML::Internal::Polygon::Polygon(const Polygon& other)
 {
 	if (other.outerBoundaryIs)
@@ -1034,6 +3259,14 @@ void KML::Internal::Polygon::save(xercesc::DOMDocument* document, xercesc::DOMEl
 		outerBoundaryIs->save(document, element);
 }
 
+void KML::Internal::Polygon::write(KmlWriter& writer) const
+{
+	writer.startElement(_X("Polygon"));
+	if (outerBoundaryIs)
+		outerBoundaryIs->write(writer);
+	writer.endElement();
+}
+
 KML::Internal::LineString::LineString() {
 	coordinates = nullptr;
 }
@@ -1041,17 +3274,15 @@ KML::Internal::LineString::LineString() {
 KML::Internal::LineString::LineString(xercesc::DOMNode * elem)
 {
 	coordinates = nullptr;
-	xercesc::DOMElement* el = dynamic_cast<xercesc::DOMElement*>(elem);
+	xercesc::DOMElement* el = asElement(elem);
 	if (el != nullptr)
 	{
-		DOMNode* node = el->getFirstChild();
-		while (node != nullptr)
+		for (auto child : ElementChildren(el))
 		{
-			if (iequals(node->getNodeName(), _X("coordinates"))) {
-				coordinates = new Coordinates(node);
+			if (child.tag == KmlTag::Coordinates) {
+				coordinates = new Coordinates(child.element);
 				break;
 			}
-			node = node->getNextSibling();
 		}
 	}
 }
@@ -1077,23 +3308,33 @@ void KML::Internal::LineString::save(xercesc::DOMDocument* document, xercesc::DO
 		coordinates->save(document, element);
 }
 
+void KML::Internal::LineString::write(KmlWriter& writer) const
+{
+	writer.startElement(_X("LineString"));
+	if (coordinates)
+		coordinates->write(writer);
+	writer.endElement();
+}
+
 KML::Internal::OuterBoundaryIs::OuterBoundaryIs(xercesc::DOMNode * elem)
     : linearRing(nullptr)
 {
-	xercesc::DOMElement* el = dynamic_cast<xercesc::DOMElement*>(elem);
+	xercesc::DOMElement* el = asElement(elem);
 	if (el != nullptr)
 	{
-		xercesc::DOMNode* node = el->getFirstChild();
-		while (node != nullptr)
+		for (auto child : ElementChildren(el))
 		{
-			if (!linearRing && iequals(node->getNodeName(), _X("LinearRing")))
-				linearRing = new LinearRing(node);
-
-			node = node->getNextSibling();
+			if (!linearRing && child.tag == KmlTag::LinearRing)
+				linearRing = new LinearRing(child.element);
 		}
 	}
 }
 
+KML::Internal::OuterBoundaryIs::OuterBoundaryIs()
+	: linearRing(nullptr)
+{
+}
+
 KML::Internal::OuterBoundaryIs::OuterBoundaryIs(const OuterBoundaryIs& other)
 {
 	if (other.linearRing)
@@ -1115,23 +3356,33 @@ void KML::Internal::OuterBoundaryIs::save(xercesc::DOMDocument* document, xerces
 		linearRing->save(document, element);
 }
 
+void KML::Internal::OuterBoundaryIs::write(KmlWriter& writer) const
+{
+	writer.startElement(_X("outerBoundaryIs"));
+	if (linearRing)
+		linearRing->write(writer);
+	writer.endElement();
+}
+
 KML::Internal::LinearRing::LinearRing(xercesc::DOMNode * elem)
     : coordinates(nullptr)
 {
-	xercesc::DOMElement* el = dynamic_cast<DOMElement*>(elem);
+	xercesc::DOMElement* el = asElement(elem);
 	if (el != nullptr)
 	{
-		xercesc::DOMNode* node = el->getFirstChild();
-		while (node != nullptr)
+		for (auto child : ElementChildren(el))
 		{
-			if (!coordinates && iequals(node->getNodeName(), _X("coordinates")))
-				coordinates = new Coordinates(node);
-
-			node = node->getNextSibling();
+			if (!coordinates && child.tag == KmlTag::Coordinates)
+				coordinates = new Coordinates(child.element);
 		}
 	}
 }
 
+KML::Internal::LinearRing::LinearRing()
+	: coordinates(nullptr)
+{
+}
+
 KML::Internal::LinearRing::LinearRing(const LinearRing& other)
     : coordinates(nullptr)
 {
@@ -1145,43 +3396,452 @@ KML::Internal::LinearRing::~LinearRing()
 		delete coordinates;
 }
 
-void KML::Internal::LinearRing::save(xercesc::DOMDocument* document, xercesc::DOMElement* parent)
+void KML::Internal::LinearRing::save(xercesc::DOMDocument* document, xercesc::DOMElement* parent)
+{
+	xercesc::DOMElement* element = document->createElement(_X("LinearRing"));
+	parent->appendChild(element);
+
+	if (coordinates)
+		coordinates->save(document, element);
+}
+
+void KML::Internal::LinearRing::write(KmlWriter& writer) const
+{
+	writer.startElement(_X("LinearRing"));
+	if (coordinates)
+		coordinates->write(writer);
+	writer.endElement();
+}
+
+KML::Internal::CoordinateTuples::CoordinateTuples()
+	: hasAltitude(false)
+{
+}
+
+void KML::Internal::CoordinateTuples::clear()
+{
+	longitude.clear();
+	latitude.clear();
+	altitude.clear();
+	hasAltitude = false;
+}
+
+KML::Internal::Coordinates::Coordinates(xercesc::DOMNode * elem)
+	: raw(nullptr),
+	  rawLength(0),
+	  tuples(nullptr)
+{
+	value = xerces_to_kml(elem->getTextContent());
+}
+
+KML::Internal::Coordinates::Coordinates()
+	: raw(nullptr),
+	  rawLength(0),
+	  tuples(nullptr)
+{
+}
+
+KML::Internal::Coordinates::Coordinates(const Coordinates& other)
+	: raw(other.raw),
+	  rawLength(other.rawLength),
+	  tuples(nullptr)
+{
+	value = other.value;
+	if (other.tuples)
+		tuples = new CoordinateTuples(*other.tuples);
+}
+
+KML::Internal::Coordinates::~Coordinates()
+{
+	if (tuples)
+		delete tuples;
+}
+
+void KML::Internal::Coordinates::save(xercesc::DOMDocument* document, xercesc::DOMElement* parent)
+{
+	xercesc::DOMElement* element = document->createElement(_X("coordinates"));
+	parent->appendChild(element);
+	element->setTextContent(kml_to_xerces(text()).c_str());
+}
+
+void KML::Internal::Coordinates::write(KmlWriter& writer) const
+{
+	if (tuples)
+		writer.tupleElement(_X("coordinates"), *tuples);
+	else if (raw)
+		writer.escapedCoordinateElement(_X("coordinates"), raw, rawLength);
+	else
+		writer.coordinateElement(_X("coordinates"), value);
+}
+
+#ifdef KML_USE_SSE2
+static inline std::uint32_t countTrailingZeros(std::uint32_t value)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, value);
+	return index;
+#else
+	return __builtin_ctz(value);
+#endif
+}
+#endif
+
+//pretty printed files indent every tuple so the runs are checked a register at a time
+template<typename CharT>
+static const CharT* skipSpace(const CharT* p, const CharT* end)
+{
+#ifdef KML_USE_SSE2
+	if constexpr (sizeof(CharT) == 1)
+	{
+		while (end - p >= 16)
+		{
+			__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+			__m128i space = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n'))),
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t'))));
+			std::uint32_t mask = static_cast<std::uint32_t>(_mm_movemask_epi8(space));
+			if (mask != 0xffff)
+				return p + countTrailingZeros(~mask);
+			p += 16;
+		}
+	}
+	else if constexpr (sizeof(CharT) == 2)
+	{
+		while (end - p >= 8)
+		{
+			__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+			__m128i space = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi16(chunk, _mm_set1_epi16(' ')), _mm_cmpeq_epi16(chunk, _mm_set1_epi16('\n'))),
+				_mm_or_si128(_mm_cmpeq_epi16(chunk, _mm_set1_epi16('\r')), _mm_cmpeq_epi16(chunk, _mm_set1_epi16('\t'))));
+			std::uint32_t mask = static_cast<std::uint32_t>(_mm_movemask_epi8(space));
+			if (mask != 0xffff)
+				return p + countTrailingZeros(~mask) / 2;
+			p += 8;
+		}
+	}
+#endif
+	while (p < end && isSpace(*p))
+		p++;
+	return p;
+}
+
+//up to 19 significant digits with a small exponent, every coordinate in practice, are converted exactly without strtod
+template<typename CharT>
+static bool parseNumber(const CharT*& p, const CharT* end, double& value)
+{
+	static constexpr double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+	const CharT* start = p;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+	{
+		negative = *p == '-';
+		p++;
+	}
+
+	std::uint64_t mantissa = 0;
+	std::int32_t digits = 0;
+	std::int32_t exponent = 0;
+	bool truncated = false;
+	bool any = false;
+	for (; p < end && *p >= '0' && *p <= '9'; p++)
+	{
+		any = true;
+		if (digits < 19)
+		{
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa)
+				digits++;
+		}
+		else
+		{
+			truncated |= *p != '0';
+			exponent++;
+		}
+	}
+	if (p < end && *p == '.')
+	{
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+		{
+			any = true;
+			if (digits < 19)
+			{
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa)
+					digits++;
+				exponent--;
+			}
+			else
+				truncated |= *p != '0';
+		}
+	}
+	if (!any)
+		return false;
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		p++;
+		bool negativeExponent = false;
+		if (p < end && (*p == '-' || *p == '+'))
+		{
+			negativeExponent = *p == '-';
+			p++;
+		}
+		if (p == end || *p < '0' || *p > '9')
+			return false;
+		std::int32_t e = 0;
+		for (; p < end && *p >= '0' && *p <= '9'; p++)
+		{
+			if (e < 100000)
+				e = e * 10 + (*p - '0');
+		}
+		exponent += negativeExponent ? -e : e;
+	}
+
+	//both values are exact so a single multiply or divide is correctly rounded
+	if (!truncated && mantissa <= (std::uint64_t(1) << 53) && exponent >= -22 && exponent <= 22)
+	{
+		double result = static_cast<double>(mantissa);
+		result = exponent < 0 ? result / powers[-exponent] : result * powers[exponent];
+		value = negative ? -result : result;
+		return true;
+	}
+
+	//anything else goes through the full parser, after the text is narrowed to ASCII
+	std::string text(start, p);
+	bool outOfRange;
+	auto last = readDouble(text.data(), text.data() + text.length(), value, outOfRange);
+	return !outOfRange && last == text.data() + text.length();
+}
+
+template<typename CharT>
+static bool parseTuples(const CharT* p, const CharT* end, CoordinateTuples& coordinates)
+{
+	//typical tuples with 6 or more decimal places are around 24 characters long
+	const std::size_t estimate = coordinates.longitude.size() + (end - p) / 24;
+	coordinates.longitude.reserve(estimate);
+	coordinates.latitude.reserve(estimate);
+	coordinates.altitude.reserve(estimate);
+
+	while ((p = skipSpace(p, end)) < end)
+	{
+		double lon, lat, alt = 0;
+		bool valid = parseNumber(p, end, lon) && p < end && *p++ == ',' && parseNumber(p, end, lat);
+		if (valid && p < end && *p == ',')
+		{
+			p++;
+			valid = parseNumber(p, end, alt);
+			coordinates.hasAltitude = true;
+		}
+		if (!valid || (p < end && !isSpace(*p)))
+			return false;
+
+		coordinates.longitude.push_back(lon);
+		coordinates.latitude.push_back(lat);
+		coordinates.altitude.push_back(alt);
+	}
+
+	return true;
+}
+
+bool KML::Internal::Coordinates::parse()
+{
+	if (!tuples)
+		tuples = new CoordinateTuples();
+	else
+		tuples->clear();
+
+	bool valid = raw ? parseTuples(raw, raw + rawLength, *tuples) : parseTuples(value.data(), value.data() + value.length(), *tuples);
+	if (!valid)
+	{
+		delete tuples;
+		tuples = nullptr;
+	}
+	return valid;
+}
+
+//the shortest text that reads back as the same double, at most 32 characters
+static std::size_t formatShortest(double value, char* buffer)
+{
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+	return static_cast<std::size_t>(std::to_chars(buffer, buffer + 32, value).ptr - buffer);
+#else
+	int length = 0;
+	for (int precision = 15; precision <= 17; precision++)
+	{
+		length = std::snprintf(buffer, 32, "%.*g", precision, value);
+		//the decimal point comes from the process locale, inf and nan are left as they are
+		const char point = *localeconv()->decimal_point;
+		for (int i = 0; point != '.' && i < length; i++)
+		{
+			if (buffer[i] == point)
+				buffer[i] = '.';
+		}
+		double check;
+		bool outOfRange;
+		readDouble(buffer, buffer + length, check, outOfRange);
+		if (check == value)
+			break;
+	}
+	return static_cast<std::size_t>(length);
+#endif
+}
+
+//rounded to 0 to 15 decimal places without trailing zeros, at most 32 characters
+static std::size_t formatFixed(double value, std::int32_t decimals, char* buffer)
+{
+	static constexpr std::uint64_t powers[] = { 1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull,
+		100000000ull, 1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull,
+		100000000000000ull, 1000000000000000ull };
+
+	//past 2^53 the double already has fewer digits than were asked for
+	double scaled = value * static_cast<double>(powers[decimals]);
+	if (!(std::fabs(scaled) < 9007199254740992.0))
+		return formatShortest(value, buffer);
+
+	std::int64_t rounded = std::llround(scaled);
+	char* p = buffer;
+	if (rounded < 0)
+	{
+		*p++ = '-';
+		rounded = -rounded;
+	}
+	std::uint64_t whole = static_cast<std::uint64_t>(rounded) / powers[decimals];
+	std::uint64_t fraction = static_cast<std::uint64_t>(rounded) % powers[decimals];
+	while (decimals && fraction % 10 == 0)
+	{
+		fraction /= 10;
+		decimals--;
+	}
+
+	char digits[20];
+	std::size_t count = 0;
+	do
+	{
+		digits[count++] = static_cast<char>('0' + whole % 10);
+		whole /= 10;
+	} while (whole);
+	while (count)
+		*p++ = digits[--count];
+
+	if (decimals)
+	{
+		*p++ = '.';
+		for (std::int32_t i = decimals - 1; i >= 0; i--)
+		{
+			p[i] = static_cast<char>('0' + fraction % 10);
+			fraction /= 10;
+		}
+		p += decimals;
+	}
+	return static_cast<std::size_t>(p - buffer);
+}
+
+//the tuples with one space between them, each number rounded to fixed decimals or the shortest text
+//that reads back when decimals is -1. A tuple without an altitude gets 0 when the others have one.
+static void formatTuples(const CoordinateTuples& tuples, std::int32_t decimals, std::string& out)
+{
+	char buffer[32];
+	auto number = [&](double value) { out.append(buffer, decimals < 0 ? formatShortest(value, buffer) : formatFixed(value, decimals, buffer)); };
+	out.clear();
+	out.reserve(tuples.longitude.size() * 24);
+	for (std::size_t i = 0; i < tuples.longitude.size(); i++)
+	{
+		if (i)
+			out.push_back(' ');
+		number(tuples.longitude[i]);
+		out.push_back(',');
+		number(tuples.latitude[i]);
+		if (tuples.hasAltitude)
+		{
+			out.push_back(',');
+			number(tuples.altitude[i]);
+		}
+	}
+}
+
+void KML::Internal::Coordinates::format()
+{
+	if (!tuples)
+		return;
+
+	std::string text;
+	formatTuples(*tuples, -1, text);
+	value.assign(text.begin(), text.end());
+	raw = nullptr;
+	rawLength = 0;
+}
+
+kml_string KML::Internal::Coordinates::text() const
+{
+	if (tuples)
+	{
+		std::string text;
+		formatTuples(*tuples, -1, text);
+		return kml_string(text.begin(), text.end());
+	}
+	if (raw)
+	{
+		kml_string text;
+		appendLineEnds(raw, raw + rawLength, text);
+		return text;
+	}
+	return value;
+}
+
+//parsed into the writer's scratch tuples, false if the text isn't a valid coordinate list
+template<typename CharT>
+static bool parseScratch(const CharT* p, const CharT* end, CoordinateTuples*& tuples)
 {
-	xercesc::DOMElement* element = document->createElement(_X("LinearRing"));
-	parent->appendChild(element);
-
-	if (coordinates)
-		coordinates->save(document, element);
+	if (!tuples)
+	{
+		ModelArena::Scope heap(nullptr);
+		tuples = new CoordinateTuples();
+	}
+	else
+		tuples->clear();
+	return parseTuples(p, end, *tuples);
 }
 
-KML::Internal::Coordinates::Coordinates(xercesc::DOMNode * elem)
+void KML::Internal::KmlWriter::coordinateElement(const xerces_char* name, const kml_string& value)
 {
-	value = elem->getTextContent();
+	//anything that isn't a coordinate list is written as it is
+	if (m_coordinatePrecision >= 0 && parseScratch(value.data(), value.data() + value.length(), m_tuples))
+		tupleElement(name, *m_tuples);
+	else
+		listElement(name, value);
 }
 
-KML::Internal::Coordinates::Coordinates(const Coordinates& other)
+void KML::Internal::KmlWriter::escapedCoordinateElement(const xerces_char* name, const char* text, std::size_t length)
 {
-	value = other.value;
+	if (m_coordinatePrecision >= 0 && parseScratch(text, text + length, m_tuples))
+		tupleElement(name, *m_tuples);
+	else
+		escapedListElement(name, text, length);
 }
 
-void KML::Internal::Coordinates::save(xercesc::DOMDocument* document, xercesc::DOMElement* parent)
+void KML::Internal::KmlWriter::tupleElement(const xerces_char* name, const CoordinateTuples& tuples)
 {
-	xercesc::DOMElement* element = document->createElement(_X("coordinates"));
-	parent->appendChild(element);
-	element->setTextContent(value.c_str());
+	formatTuples(tuples, m_coordinatePrecision, m_asciiList);
+	escapedTextElement(name, m_asciiList.data(), m_asciiList.length());
 }
 
-KML::Internal::Output::OutputDocument::OutputDocument(Input::InputDocument * document, const HSS_Time::WTimeSpan& offset)
+KML::Internal::Output::OutputDocument::OutputDocument(Input::InputDocument * document)
 	: folder(nullptr),
 	  schema(nullptr)
 {
 	id = document->id;
 	if (document->folder)
-		folder = new OutputFolder(document->folder, offset);
+		folder = new OutputFolder(document->folder);
 	if (document->schema)
 		schema = new OutputSchema(document->schema);
 }
 
+void KML::Internal::Output::OutputDocument::applyOffset(Input::InputDocument* document, OutputTimeContext& context)
+{
+	if (folder)
+		folder->applyOffset(document->folder, context);
+}
+
 KML::Internal::Output::OutputDocument::~OutputDocument()
 {
 	if (folder)
@@ -1190,214 +3850,319 @@ KML::Internal::Output::OutputDocument::~OutputDocument()
 		delete schema;
 }
 
-void KML::Internal::Output::OutputDocument::save(xercesc::DOMDocument* document, xercesc::DOMElement* parent)
+void KML::Internal::Output::OutputDocument::write(KmlWriter& writer, bool sharedStyles) const
 {
-	xercesc::DOMElement* element = document->createElement(_X("Document"));
-	parent->appendChild(element);
+	writer.startElement(_X("Document"));
 
-	if (folder)
-		folder->save(document, element);
+	if (folder && sharedStyles)
+	{
+		//the table only lives while the file is written, several files can be written at once
+		ModelArena::Scope heap(nullptr);
+		OutputStyleTable styles(folder);
+		styles.write(writer);
+		folder->write(writer, &styles);
+	}
+	else if (folder)
+		folder->write(writer);
 	if (schema)
-		schema->save(document, element);
+		schema->write(writer);
+
+	writer.endElement();
 }
 
-KML::Internal::Output::OutputFolder::OutputFolder(Input::InputFolder * folder, const HSS_Time::WTimeSpan& offset)
+KML::Internal::Output::OutputFolder::OutputFolder(Input::InputFolder * folder)
 	: schema(nullptr)
 {
 	name = folder->name;
 	if (folder->schema)
 		schema = new OutputSchema(folder->schema);
 	for (auto it = folder->placemark.begin(); it != folder->placemark.end(); it++)
-		placemark.push_back(new OutputPlacemark((*it), offset));
-}
-
-KML::Internal::Output::OutputFolder::~OutputFolder()
-{
-	if (schema)
-		delete schema;
-	for (auto it = placemark.begin(); it != placemark.end(); it++)
-		delete (*it);
-	placemark.clear();
+		placemark.push_back(new OutputPlacemark(*it));
 }
 
-void KML::Internal::Output::OutputFolder::save(xercesc::DOMDocument* document, xercesc::DOMElement* parent)
+//location is constructed before the manager, its timezone has to be set before the manager is built from it
+static HSS_Time::WorldLocation& withTimezone(HSS_Time::WorldLocation& location, const HSS_Time::WTimeSpan& offset)
 {
-	xercesc::DOMElement* element = document->createElement(_X("Folder"));
-	parent->appendChild(element);
-
-	if (schema)
-		schema->save(document, element);
-	for (auto it = placemark.begin(); it != placemark.end(); it++)
-		(*it)->save(document, element);
-
-	xercesc::DOMElement* nameElement = document->createElement(_X("name"));
-	nameElement->setTextContent(name.c_str());
-	element->appendChild(nameElement);
+	location.m_timezone(offset);
+	return location;
 }
 
-KML::Internal::Output::OutputSchema::OutputSchema(Input::InputSchema* schema)
+KML::Internal::Output::OutputTimeContext::OutputTimeContext(const HSS_Time::WTimeSpan& offset)
+	: manager(withTimezone(location, offset)),
+	  m_offset(offset.GetTotalSeconds()),
+	  m_fastPath(true),
+	  m_isoChecked(false),
+	  m_localChecked(false)
 {
-	id = schema->id;
-	name = schema->name;
-	for (auto it = schema->simpleField.begin(); it != schema->simpleField.end(); it++)
-		simpleField.push_back(new SimpleField(*(*it)));
 }
 
-KML::Internal::Output::OutputSchema::~OutputSchema()
+bool KML::Internal::Output::OutputTimeContext::calibrate(const kml_string& text, std::uint32_t flags, std::int64_t seconds)
 {
-	for (auto it = simpleField.begin(); it != simpleField.end(); it++)
-		delete (*it);
-	simpleField.clear();
+	WTime time(&manager);
+	time.ParseDateTime(kml_to_utf8(text), flags);
+	kml_string expected = utf8_to_kml(time.ToString(WTIME_FORMAT_STRING_ISO8601));
+
+	kml_char local[19];
+	formatDateTime(seconds + m_offset, local);
+	if (expected.length() < 19 || expected.compare(0, 19, local, 19) != 0)
+		return false;
+
+	//everything after the time is the timezone, it is the same for every time in this offset
+	auto suffix = expected.substr(19);
+	if ((m_isoChecked || m_localChecked) && suffix != m_suffix)
+		return false;
+	m_suffix = suffix;
+	return true;
 }
 
-void KML::Internal::Output::OutputSchema::save(xercesc::DOMDocument* document, xercesc::DOMElement* parent)
+bool KML::Internal::Output::OutputTimeContext::parseSeconds(const Input::InputPlacemark* placemark, std::int64_t& seconds, bool& hasTime)
 {
-	xercesc::DOMElement* element = document->createElement(_X("Schema"));
-	parent->appendChild(element);
+	if (!m_fastPath)
+		return false;
 
-	element->setAttribute(_X("name"), name.c_str());
-	element->setAttribute(_X("id"), id.c_str());
+	hasTime = false;
+	if (placemark->time.length() > 0)
+	{
+		hasTime = true;
+		if (!parseIso8601(placemark->time.c_str(), placemark->time.length(), seconds))
+			return false;
+		if (!m_isoChecked)
+		{
+			m_fastPath = calibrate(placemark->time, WTIME_FORMAT_STRING_ISO8601, seconds);
+			m_isoChecked = true;
+		}
+	}
+	else if (placemark->extendedData && placemark->extendedData->schemaData)
+	{
+		auto value = placemark->extendedData->schemaData->value(InputDataTable::Role::Timestamp);
+		if (value && value->length() > 0)
+		{
+			hasTime = true;
+			//the timestamp is a local time in the offset
+			if (!parseDateTime(value->c_str(), value->length(), seconds))
+				return false;
+			seconds -= m_offset;
+			if (!m_localChecked)
+			{
+				m_fastPath = calibrate(*value, WTIME_FORMAT_DATE | WTIME_FORMAT_TIME | WTIME_FORMAT_STRING_YYYY_MM_DD | WTIME_FORMAT_AS_LOCAL, seconds);
+				m_localChecked = true;
+			}
+		}
+	}
 
-	for (auto it = simpleField.begin(); it != simpleField.end(); it++)
-		(*it)->save(document, element);
+	return m_fastPath;
 }
 
-KML::Internal::Output::OutputPlacemark::OutputPlacemark(Input::InputPlacemark* placemark, const HSS_Time::WTimeSpan& offset)
-	: style(nullptr),
-	  extendedData(nullptr),
-	  lineString(nullptr),
-	  timeSpan(nullptr)
+kml_string KML::Internal::Output::OutputTimeContext::formatSeconds(std::int64_t seconds) const
 {
-	xerces_string start;
-	xerces_string end;
-
-	WorldLocation location;
-	location.m_timezone(offset);
-	WTimeManager manager(location);
-	WTime endTime(&manager);
-
-#ifndef XERCES_USE_U
-	std::wstring_convert<std::codecvt_utf8_utf16<xerces_char>> converter;
-#endif
+	kml_string result(19 + m_suffix.length(), _K(' '));
+	formatDateTime(seconds + m_offset, &result[0]);
+	std::copy(m_suffix.begin(), m_suffix.end(), result.begin() + 19);
+	return result;
+}
 
-	WTime startTime(&manager);
+bool KML::Internal::Output::OutputTimeContext::parse(const Input::InputPlacemark* placemark, HSS_Time::WTime& time) const
+{
 	if (placemark->time.length() > 0)
 	{
-		start = placemark->time;
 #ifdef XERCES_USE_U
-		std::string cstart(utf16_to_utf8(start));
-		startTime.ParseDateTime(cstart, WTIME_FORMAT_STRING_ISO8601);
-		start = utf8_to_utf16(startTime.ToString(WTIME_FORMAT_STRING_ISO8601));
+		time.ParseDateTime(kml_to_utf8(placemark->time), WTIME_FORMAT_STRING_ISO8601);
 #else
-		startTime.ParseDateTime(start, WTIME_FORMAT_STRING_ISO8601);
-		start = converter.from_bytes(startTime.ToString(WTIME_FORMAT_STRING_ISO8601));
+		time.ParseDateTime(placemark->time, WTIME_FORMAT_STRING_ISO8601);
 #endif
+		return true;
 	}
-	else
+	else if (placemark->extendedData && placemark->extendedData->schemaData)
 	{
-		for (auto it = placemark->extendedData->schemaData->simpleData.begin(); it != placemark->extendedData->schemaData->simpleData.end(); it++)
-		{
-			if (iequals((*it)->name, _X("TIMESTAMP")))
-			{
-				start = (*it)->value;
+		auto value = placemark->extendedData->schemaData->value(InputDataTable::Role::Timestamp);
+		if (!value || value->length() == 0)
+			return false;
 #ifdef XERCES_USE_U
-				std::string cstart(utf16_to_utf8(start));
-				startTime.ParseDateTime(cstart, WTIME_FORMAT_DATE | WTIME_FORMAT_TIME | WTIME_FORMAT_STRING_YYYY_MM_DD | WTIME_FORMAT_AS_LOCAL);
-				start = utf8_to_utf16(startTime.ToString(WTIME_FORMAT_STRING_ISO8601));
+		time.ParseDateTime(kml_to_utf8(*value), WTIME_FORMAT_DATE | WTIME_FORMAT_TIME | WTIME_FORMAT_STRING_YYYY_MM_DD | WTIME_FORMAT_AS_LOCAL);
 #else
-				startTime.ParseDateTime(start, WTIME_FORMAT_DATE | WTIME_FORMAT_TIME | WTIME_FORMAT_STRING_YYYY_MM_DD | WTIME_FORMAT_AS_LOCAL);
-				start = converter.from_bytes(startTime.ToString(WTIME_FORMAT_STRING_ISO8601));
+		time.ParseDateTime(*value, WTIME_FORMAT_DATE | WTIME_FORMAT_TIME | WTIME_FORMAT_STRING_YYYY_MM_DD | WTIME_FORMAT_AS_LOCAL);
 #endif
+		return true;
+	}
 
-				break;
-			}
+	return false;
+}
+
+const kml_string& KML::Internal::Output::OutputTimeContext::format(const HSS_Time::WTime& time)
+{
+	//placemarks from the same timestep share their start and end times
+	auto inserted = m_formatted.emplace(static_cast<std::uint64_t>(time.GetTime(0)), kml_string());
+	if (inserted.second)
+	{
+		inserted.first->second = utf8_to_kml(time.ToString(WTIME_FORMAT_STRING_ISO8601));
+	}
+	return inserted.first->second;
+}
+
+void KML::Internal::Output::OutputFolder::applyOffset(Input::InputFolder* folder, OutputTimeContext& context)
+{
+	//only the time spans go in the output's arena, the parsed and formatted times are temporary
+	ModelArena* arena = ModelArena::current();
+	ModelArena::Scope temporary(nullptr);
+
+	auto count = placemark.size();
+	std::vector<bool> hasTime(count);
+	//comparable values for the times, seconds since 1970 on the fast path or WTime's own units otherwise
+	std::vector<std::int64_t> keys(count);
+	std::vector<WTime> times;
+
+	//parse the time of every placemark once
+	bool fast = true;
+	for (std::size_t i = 0; i < count && fast; i++)
+	{
+		bool has;
+		fast = context.parseSeconds(folder->placemark[i], keys[i], has);
+		hasTime[i] = has;
+	}
+	if (!fast)
+	{
+		//at least one time needs WTime to parse it, use WTime for all of them so they are comparable
+		times.reserve(count);
+		for (std::size_t i = 0; i < count; i++)
+		{
+			times.emplace_back(&context.manager);
+			hasTime[i] = context.parse(folder->placemark[i], times.back());
+			keys[i] = static_cast<std::int64_t>(times.back().GetTime(0));
 		}
 	}
-	if (start.length() > 0)
+
+	//a placemark's time span ends just before the next placemark with a later time, that is
+	//found for every placemark in a single reverse sweep. The stack holds the indices of the
+	//placemarks after the current one that could still end a span, with the earliest time on top.
+	std::vector<std::size_t> later;
+	//the output placemarks are in the same order as the input placemarks
+	for (std::size_t i = count; i-- > 0; )
 	{
-		InputPlacemark* next = placemark->_next;
-		while (next && end.length() == 0)
+		if (!hasTime[i])
 		{
-			if (next->time.length() > 0)
-			{
-				end = next->time;
-#ifdef XERCES_USE_U
-				std::string cend(utf16_to_utf8(end));
-				endTime.ParseDateTime(cend, WTIME_FORMAT_STRING_ISO8601);
-#else
-				endTime.ParseDateTime(end, WTIME_FORMAT_STRING_ISO8601);
-#endif
-			}
-			else
-			{
-				for (auto it = next->extendedData->schemaData->simpleData.begin(); it != next->extendedData->schemaData->simpleData.end(); it++)
-				{
-					if (iequals((*it)->name, _X("TIMESTAMP")))
-					{
-						end = (*it)->value;
-#ifdef XERCES_USE_U
-						std::string cend(utf16_to_utf8(end));
-						endTime.ParseDateTime(cend, WTIME_FORMAT_DATE | WTIME_FORMAT_TIME | WTIME_FORMAT_STRING_YYYY_MM_DD | WTIME_FORMAT_AS_LOCAL);
-#else
-						endTime.ParseDateTime(end, WTIME_FORMAT_DATE | WTIME_FORMAT_TIME | WTIME_FORMAT_STRING_YYYY_MM_DD | WTIME_FORMAT_AS_LOCAL);
-#endif
-						break;
-					}
-				}
-			}
+			ModelArena::Scope nodes(arena);
+			placemark[i]->setTimeSpan(kml_string(), kml_string());
+			continue;
+		}
 
-			if (end.length())
-			{
-				//only break if a time in the future has been found, will work around having multiple placemarks with the same time
-				if (endTime.GetTime(0) > startTime.GetTime(0))
-					break;
-				else
-					end.clear();
-			}
+		//placemarks at or before this time can't end the span of this placemark or any before it
+		while (later.size() && keys[later.back()] <= keys[i])
+			later.pop_back();
 
-			next = next->_next;
+		kml_string end;
+		if (fast)
+		{
+			if (later.size() && (keys[later.back()] - 1) > keys[i])
+				end = context.formatSeconds(keys[later.back()] - 1);
+			auto start = context.formatSeconds(keys[i]);
+			ModelArena::Scope nodes(arena);
+			placemark[i]->setTimeSpan(start, end);
 		}
-
-		if (end.length())
+		else
 		{
-			endTime -= WTimeSpan(1);
-			if (endTime.GetTime(0) > startTime.GetTime(0))
+			if (later.size())
 			{
-#ifdef XERCES_USE_U
-				end = utf8_to_utf16(endTime.ToString(WTIME_FORMAT_STRING_ISO8601));
-#else
-				end = converter.from_bytes(endTime.ToString(WTIME_FORMAT_STRING_ISO8601));
-#endif
+				WTime endTime(times[later.back()]);
+				endTime -= WTimeSpan(1);
+				if (endTime.GetTime(0) > times[i].GetTime(0))
+					end = context.format(endTime);
 			}
-			else
-				end = _X("");
+			auto& start = context.format(times[i]);
+			ModelArena::Scope nodes(arena);
+			placemark[i]->setTimeSpan(start, end);
 		}
+
+		later.push_back(i);
 	}
-	timeSpan = new OutputTimeSpan(start, end);
+}
+
+KML::Internal::Output::OutputFolder::~OutputFolder()
+{
+	if (schema)
+		delete schema;
+	for (auto it = placemark.begin(); it != placemark.end(); it++)
+		delete (*it);
+	placemark.clear();
+}
+
+void KML::Internal::Output::OutputFolder::write(KmlWriter& writer, const OutputStyleTable* styles) const
+{
+	writer.startElement(_X("Folder"));
+
+	if (schema)
+		schema->write(writer);
+	for (auto it = placemark.begin(); it != placemark.end(); it++)
+		(*it)->write(writer, styles);
+
+	writer.textElement(_X("name"), name);
+
+	writer.endElement();
+}
+
+KML::Internal::Output::OutputSchema::OutputSchema(Input::InputSchema* schema)
+{
+	id = schema->id;
+	name = schema->name;
+	simpleField.assign(schema->simpleField.begin(), schema->simpleField.end());
+}
+
+KML::Internal::Output::OutputSchema::~OutputSchema()
+{
+	simpleField.clear();
+}
+
+void KML::Internal::Output::OutputSchema::write(KmlWriter& writer) const
+{
+	writer.startElement(_X("Schema"));
+
+	writer.attribute(_X("name"), name);
+	writer.attribute(_X("id"), id);
+
+	for (auto it = simpleField.begin(); it != simpleField.end(); it++)
+		(*it)->write(writer);
+
+	writer.endElement();
+}
+
+KML::Internal::Output::OutputPlacemark::OutputPlacemark(Input::InputPlacemark* placemark)
+	: style(nullptr),
+	  extendedData(nullptr),
+	  lineString(nullptr),
+	  timeSpan(nullptr)
+{
 	name = placemark->name;
 	if (placemark->style)
 		style = new OutputStyle(placemark->style);
 	else
 		style = new OutputStyle();
 	int32_t width = 1;
-	xerces_string color = _X("ff0000ff");
-	if (placemark->extendedData) {
-		for (auto it = placemark->extendedData->schemaData->simpleData.begin(); it != placemark->extendedData->schemaData->simpleData.end(); it++)
-		{
-			if (iequals((*it)->name, _X("WIDTH")))
-				width = (int)(stod((*it)->value.c_str()));
-			else if (iequals((*it)->name, _X("COLOR")))
-				color = (*it)->value;
-		}
+	InternedString color = intern(_K("ff0000ff"));
+	if (placemark->extendedData && placemark->extendedData->schemaData) {
+		auto data = placemark->extendedData->schemaData;
+		if (auto value = data->value(InputDataTable::Role::Width))
+			width = (int)(KML::Internal::stod(value->str()));
+		if (auto value = data->value(InputDataTable::Role::Color))
+			color = *value;
 	}
 	style->lineStyle->width = width;
 	style->lineStyle->color = color;
 	if (placemark->extendedData)
 		extendedData = new OutputExtendedData(placemark->extendedData);
-	for (auto p : placemark->polygons)
-		polygons.push_back(new Polygon(*p));
-	if (placemark->lineString)
-		lineString = new LineString(*placemark->lineString);
+	//the geometry is written unchanged so it is shared with the input
+	polygons.assign(placemark->polygons.begin(), placemark->polygons.end());
+	lineString = placemark->lineString;
+}
+
+void KML::Internal::Output::OutputPlacemark::setTimeSpan(const kml_string& start, const kml_string& end)
+{
+	//the times are the same length for every offset so the existing strings are reused
+	if (timeSpan)
+	{
+		timeSpan->begin = start;
+		timeSpan->end = end;
+	}
+	else
+		timeSpan = new OutputTimeSpan(start, end);
 }
 
 KML::Internal::Output::OutputPlacemark::~OutputPlacemark()
@@ -1406,69 +4171,61 @@ KML::Internal::Output::OutputPlacemark::~OutputPlacemark()
 		delete style;
 	if (extendedData)
 		delete extendedData;
-	for (auto p : polygons)
-		delete p;
 	polygons.clear();
-	if (lineString)
-		delete lineString;
 	if (timeSpan)
 		delete timeSpan;
 }
 
-void KML::Internal::Output::OutputPlacemark::save(xercesc::DOMDocument* document, xercesc::DOMElement* parent)
+void KML::Internal::Output::OutputPlacemark::write(KmlWriter& writer, const OutputStyleTable* styles) const
 {
-	xercesc::DOMElement* element = document->createElement(_X("Placemark"));
-	parent->appendChild(element);
+	writer.startElement(_X("Placemark"));
 
 	if (timeSpan)
-		timeSpan->save(document, element);
+		timeSpan->write(writer);
 
-	xercesc::DOMElement* nameElement = document->createElement(_X("name"));
-	nameElement->setTextContent(name.c_str());
-	element->appendChild(nameElement);
+	writer.textElement(_X("name"), name);
 
 	if (style)
-		style->save(document, element);
+	{
+		if (styles)
+			writer.textElement(_X("styleUrl"), styles->url(style));
+		else
+			style->write(writer);
+	}
 	if (extendedData)
-		extendedData->save(document, element);
+		extendedData->write(writer);
 	if (polygons.size() == 1)
-		polygons[0]->save(document, element);
+		polygons[0]->write(writer);
 	else if (polygons.size() > 1)
 	{
-		xercesc::DOMElement* multiElement = document->createElement(_X("MultiGeometry"));
-		element->appendChild(multiElement);
+		writer.startElement(_X("MultiGeometry"));
 		for (auto p : polygons)
-			p->save(document, multiElement);
+			p->write(writer);
+		writer.endElement();
 	}
 	if (lineString)
-		lineString->save(document, element);
+		lineString->write(writer);
+
+	writer.endElement();
 }
 
-KML::Internal::Output::OutputTimeSpan::OutputTimeSpan(xerces_string start, xerces_string end)
+KML::Internal::Output::OutputTimeSpan::OutputTimeSpan(const kml_string& start, const kml_string& end)
 	: begin(start), end(end)
 {
 }
 
-void KML::Internal::Output::OutputTimeSpan::save(xercesc::DOMDocument* document, xercesc::DOMElement* parent)
+void KML::Internal::Output::OutputTimeSpan::write(KmlWriter& writer) const
 {
 	if (begin.length() || end.length())
 	{
-		xercesc::DOMElement* element = document->createElement(_X("TimeSpan"));
-		parent->appendChild(element);
+		writer.startElement(_X("TimeSpan"));
 
 		if (begin.length())
-		{
-			xercesc::DOMElement* beginElement = document->createElement(_X("begin"));
-			beginElement->setTextContent(begin.c_str());
-			element->appendChild(beginElement);
-		}
-
+			writer.textElement(_X("begin"), begin);
 		if (end.length())
-		{
-			xercesc::DOMElement* endElement = document->createElement(_X("end"));
-			endElement->setTextContent(end.c_str());
-			element->appendChild(endElement);
-		}
+			writer.textElement(_X("end"), end);
+
+		writer.endElement();
 	}
 }
 
@@ -1485,39 +4242,41 @@ KML::Internal::Output::OutputExtendedData::~OutputExtendedData()
 		delete schemaData;
 }
 
-void KML::Internal::Output::OutputExtendedData::save(xercesc::DOMDocument* document, xercesc::DOMElement* parent)
+void KML::Internal::Output::OutputExtendedData::write(KmlWriter& writer) const
 {
-	xercesc::DOMElement* element = document->createElement(_X("ExtendedData"));
-	parent->appendChild(element);
+	writer.startElement(_X("ExtendedData"));
 
 	if (schemaData)
-		schemaData->save(document, element);
+		schemaData->write(writer);
+
+	writer.endElement();
 }
 
 KML::Internal::Output::OutputSchemaData::OutputSchemaData(Input::InputSchemaData* data)
+	: table(data->table),
+	  row(data->row)
 {
 	schemaUrl = data->schemaUrl;
-	for (auto it = data->simpleData.begin(); it != data->simpleData.end(); it++)
+	for (auto it = data->columns.begin(); it != data->columns.end(); it++)
 	{
-		if (!iequals((*it)->name, _X("WIDTH")) && !iequals((*it)->name, _X("COLOR")) && !iequals((*it)->name, _X("TIMESTAMP")))
-			simpleData.push_back(new SimpleData(*(*it)));
+		if (table->columns[*it].role == InputDataTable::Role::None)
+			columns.push_back(*it);
 	}
 }
 
 KML::Internal::Output::OutputSchemaData::~OutputSchemaData()
 {
-	for (auto it = simpleData.begin(); it != simpleData.end(); it++)
-		delete (*it);
-	simpleData.clear();
+	columns.clear();
 }
 
-void KML::Internal::Output::OutputSchemaData::save(xercesc::DOMDocument* document, xercesc::DOMElement* parent)
+void KML::Internal::Output::OutputSchemaData::write(KmlWriter& writer) const
 {
-	xercesc::DOMElement* element = document->createElement(_X("SchemaData"));
-	parent->appendChild(element);
+	writer.startElement(_X("SchemaData"));
 
-	for (auto it = simpleData.begin(); it != simpleData.end(); it++)
-		(*it)->save(document, element);
+	for (auto it = columns.begin(); it != columns.end(); it++)
+		table->write(writer, row, *it);
+
+	writer.endElement();
 }
 
 KML::Internal::Output::OutputStyle::OutputStyle(Input::InputStyle* style)
@@ -1546,15 +4305,82 @@ KML::Internal::Output::OutputStyle::~OutputStyle()
 		delete polyStyle;
 }
 
-void KML::Internal::Output::OutputStyle::save(xercesc::DOMDocument* document, xercesc::DOMElement* parent)
+void KML::Internal::Output::OutputStyle::write(KmlWriter& writer) const
 {
-	xercesc::DOMElement* element = document->createElement(_X("Style"));
-	parent->appendChild(element);
+	writer.startElement(_X("Style"));
 
 	if (lineStyle)
-		lineStyle->save(document, element);
+		lineStyle->write(writer);
 	if (polyStyle)
-		polyStyle->save(document, element);
+		polyStyle->write(writer);
+
+	writer.endElement();
+}
+
+bool KML::Internal::Output::OutputStyleTable::Key::operator==(const Key& other) const
+{
+	//the output defaults are interned in the input's table so equal colours have equal handles
+	auto line = style->lineStyle, otherLine = other.style->lineStyle;
+	if (!line != !otherLine || (line && (line->color != otherLine->color || line->width != otherLine->width)))
+		return false;
+	auto poly = style->polyStyle, otherPoly = other.style->polyStyle;
+	return !poly == !otherPoly && (!poly || poly->fill == otherPoly->fill);
+}
+
+std::size_t KML::Internal::Output::OutputStyleTable::KeyHash::operator()(const Key& key) const
+{
+	std::size_t hash = 0;
+	auto combine = [&hash](std::size_t value) { hash ^= value + 0x9e3779b9 + (hash << 6) + (hash >> 2); };
+	if (key.style->lineStyle)
+	{
+		combine(std::hash<const kml_char*>()(key.style->lineStyle->color.c_str()));
+		combine(std::hash<std::int32_t>()(key.style->lineStyle->width));
+	}
+	if (key.style->polyStyle)
+		combine(std::hash<const kml_char*>()(key.style->polyStyle->fill.c_str()));
+	return hash;
+}
+
+KML::Internal::Output::OutputStyleTable::OutputStyleTable(const OutputFolder* folder)
+{
+	for (auto it = folder->placemark.begin(); it != folder->placemark.end(); it++)
+	{
+		auto style = (*it)->style;
+		if (!style)
+			continue;
+
+		//styles are numbered in the order they are first used
+		auto inserted = m_index.emplace(Key{ style }, m_styles.size());
+		if (inserted.second)
+		{
+			char buffer[24] = "#style";
+			auto result = std::to_chars(buffer + 6, buffer + sizeof(buffer), m_styles.size() + 1);
+			m_styles.push_back(style);
+			m_urls.emplace_back(buffer, result.ptr);
+		}
+	}
+}
+
+void KML::Internal::Output::OutputStyleTable::write(KmlWriter& writer) const
+{
+	for (std::size_t i = 0; i < m_styles.size(); i++)
+	{
+		writer.startElement(_X("Style"));
+		//the id is the url without the leading #
+		writer.attribute(_X("id"), m_urls[i].substr(1));
+
+		if (m_styles[i]->lineStyle)
+			m_styles[i]->lineStyle->write(writer);
+		if (m_styles[i]->polyStyle)
+			m_styles[i]->polyStyle->write(writer);
+
+		writer.endElement();
+	}
+}
+
+const kml_string& KML::Internal::Output::OutputStyleTable::url(const OutputStyle* style) const
+{
+	return m_urls[m_index.find(Key{ style })->second];
 }
 
 KML::Internal::Output::OutputLineStyle::OutputLineStyle(Input::InputLineStyle* style)
@@ -1565,27 +4391,19 @@ KML::Internal::Output::OutputLineStyle::OutputLineStyle(Input::InputLineStyle* s
 
 KML::Internal::Output::OutputLineStyle::OutputLineStyle()
 {
-	color = _X("ff0000ff");
+	color = intern(_K("ff0000ff"));
 	width = 1;
 }
 
-void KML::Internal::Output::OutputLineStyle::save(xercesc::DOMDocument* document, xercesc::DOMElement* parent)
+void KML::Internal::Output::OutputLineStyle::write(KmlWriter& writer) const
 {
-	xercesc::DOMElement* element = document->createElement(_X("LineStyle"));
-	parent->appendChild(element);
+	writer.startElement(_X("LineStyle"));
 
-	xercesc::DOMElement* colorElement = document->createElement(_X("color"));
-	colorElement->setTextContent(color.c_str());
-	element->appendChild(colorElement);
+	writer.textElement(_X("color"), color);
 
-	xercesc::DOMElement* widthElement = document->createElement(_X("width"));
+	char buffer[16];
+	auto result = std::to_chars(buffer, buffer + sizeof(buffer), width);
+	writer.textElement(_X("width"), kml_string(buffer, result.ptr));
 
-#ifdef XERCES_USE_U
-	std::string ctemp = std::to_string(width);
-	xerces_string temp = utf8_to_utf16(ctemp);
-#else
-	xerces_string temp = std::to_wstring(width);
-#endif
-	widthElement->setTextContent(temp.c_str());
-	element->appendChild(widthElement);
+	writer.endElement();
 }
@@ -19,6 +19,12 @@
 #include "kmllib.h"
 #include "kmlinternal.h"
 
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <thread>
+
 using namespace xercesc;
 
 
@@ -30,10 +36,15 @@ void Java::read_job_directory(const kmlFs::path& path, std::string& job_director
 }
 
 KML::KmlHelper::KmlHelper(const kmlFs::path& input) :
+	KmlHelper(input, KmlInputOptions())
+{
+}
+
+KML::KmlHelper::KmlHelper(const kmlFs::path& input, const KmlInputOptions& options) :
 	m_errors(0)
 {
 	initializeXML();
-	m_inputFile = new KML::Internal::Input::InputKmlFile(input);
+	m_inputFile = new KML::Internal::Input::InputKmlFile(input, options.streaming, options.passthroughGeometry);
 }
 
 KML::KmlHelper::~KmlHelper()
@@ -50,11 +61,99 @@ bool KML::KmlHelper::process(const kmlFs::path& output)
 }
 
 bool KML::KmlHelper::process(const kmlFs::path& output, const HSS_Time::WTimeSpan& offset)
+{
+	return process(output, offset, KmlOutputOptions());
+}
+
+bool KML::KmlHelper::process(const kmlFs::path& output, const HSS_Time::WTimeSpan& offset, const KmlOutputOptions& options)
 {
 	if (m_inputFile)
 	{
 		KML::Internal::Output::OutputKmlFile outkml(m_inputFile, offset);
-		return outkml.save(output);
+		return outkml.save(output, options);
 	}
 	return false;
 }
+
+bool KML::KmlHelper::process(const std::vector<KmlOutputTarget>& targets, const KmlOutputOptions& options)
+{
+	if (!m_inputFile)
+		return false;
+	if (targets.empty())
+		return true;
+
+	//every KMZ target starts its own compression threads so fewer are written at once
+	std::size_t workers = std::max(std::thread::hardware_concurrency(), 1U) / std::max(options.compressionThreads, 1U);
+	workers = std::max(workers, static_cast<std::size_t>(1));
+
+	//targets with the same offset are next to each other so a worker only rebuilds the parts of its
+	//output that depend on the offset when it moves on to the next offset
+	std::vector<const KmlOutputTarget*> order;
+	order.reserve(targets.size());
+	std::vector<bool> grouped(targets.size(), false);
+	for (std::size_t i = 0; i < targets.size(); i++)
+	{
+		for (std::size_t j = i; j < targets.size(); j++)
+		{
+			if (!grouped[j] && targets[j].offset == targets[i].offset)
+			{
+				grouped[j] = true;
+				order.push_back(&targets[j]);
+			}
+		}
+	}
+
+	std::atomic<std::size_t> next(0);
+	std::atomic<std::size_t> failed(0);
+	auto write = [&]() {
+		//each worker has its own output so the time spans of one offset aren't changed under another
+		std::unique_ptr<KML::Internal::Output::OutputKmlFile> outkml;
+		const HSS_Time::WTimeSpan* offset = nullptr;
+		for (auto index = next++; index < order.size(); index = next++)
+		{
+			auto target = order[index];
+			bool saved;
+			try
+			{
+				if (!outkml)
+					outkml = std::make_unique<KML::Internal::Output::OutputKmlFile>(m_inputFile, target->offset);
+				else if (!(target->offset == *offset))
+					outkml->applyOffset(m_inputFile, target->offset);
+				offset = &target->offset;
+				saved = outkml->save(target->path, options, target->format);
+			}
+			catch (...)
+			{
+				//the output may be part way to another offset so it is built again for the next target
+				outkml.reset();
+				saved = false;
+			}
+			if (!saved)
+				failed++;
+		}
+	};
+
+	std::vector<std::thread> threads;
+	try
+	{
+		for (std::size_t j = 1; j < std::min(workers, order.size()); j++)
+			threads.emplace_back(write);
+	}
+	catch (...)
+	{
+		//write the rest on this thread if no more can be started
+	}
+	write();
+	for (auto& thread : threads)
+		thread.join();
+
+	bool success = failed == 0;
+	if (!success)
+	{
+		//the count stops at the largest value GetErrors can return
+		std::size_t errors = static_cast<std::size_t>(std::max<std::int16_t>(m_errors, 0)) + failed;
+		m_errors = static_cast<std::int16_t>(std::min<std::size_t>(errors, std::numeric_limits<std::int16_t>::max()));
+	}
+
+	return success;
+}
@@ -19,9 +19,16 @@
 #pragma once
 
 #include "types.h"
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 #include "filesystem.hpp"
 #include "WTime.h"
+#include "kmllib.h"
 
 #include <xercesc/dom/DOM.hpp>
 #include <xercesc/dom/DOMDocument.hpp>
@@ -36,6 +43,12 @@
 #include <xercesc/framework/MemBufInputSource.hpp>
 #include <xercesc/framework/MemBufFormatTarget.hpp>
 #include <xercesc/parsers/XercesDOMParser.hpp>
+#include <xercesc/sax/InputSource.hpp>
+#include <xercesc/sax2/Attributes.hpp>
+#include <xercesc/sax2/DefaultHandler.hpp>
+#include <xercesc/sax2/SAX2XMLReader.hpp>
+#include <xercesc/sax2/XMLReaderFactory.hpp>
+#include <xercesc/util/BinInputStream.hpp>
 #include <xercesc/util/XMLUni.hpp>
 
 #include <xercesc/framework/LocalFileFormatTarget.hpp>
@@ -51,6 +64,124 @@ typedef wchar_t xerces_char;
 #define _X(text) L##text
 #endif
 
+namespace KML::Internal
+{
+	class StringTable;
+
+	//every node, string, and list of one model is allocated from the arena, an arena is only used by
+	//the thread that builds the model. The model is still deleted before its arena so anything that
+	//ended up on the heap is freed.
+	class ModelArena
+	{
+	public:
+		//strings are interned in the table of another arena so handles from both models compare equal,
+		//that arena has to outlive this one
+		explicit ModelArena(ModelArena* strings = nullptr);
+		ModelArena(const ModelArena&) = delete;
+		ModelArena& operator=(const ModelArena&) = delete;
+		virtual ~ModelArena();
+
+		void* allocate(std::size_t size, std::size_t alignment);
+
+		//null when model objects are allocated on the heap
+		static ModelArena* current();
+		StringTable& strings();
+		//bytes taken from the heap for the arena's blocks
+		std::size_t reserved() const { return m_reserved; }
+
+		//a null arena moves allocations back to the heap, for temporaries that shouldn't grow the arena
+		class Scope
+		{
+		public:
+			explicit Scope(ModelArena* arena);
+			Scope(const Scope&) = delete;
+			Scope& operator=(const Scope&) = delete;
+			~Scope();
+
+		private:
+			ModelArena* m_previous;
+		};
+
+	private:
+		struct Block
+		{
+			Block* previous;
+		};
+
+		Block* m_block;
+		char* m_next;
+		char* m_end;
+		std::size_t m_blockSize;
+		std::size_t m_reserved;
+		StringTable* m_strings;
+		bool m_ownsStrings;
+	};
+
+	//allocates from the arena that was current when the allocator was created. Assigning to a
+	//container keeps its arena and copies the elements in if the source is in another arena,
+	//swapping exchanges the arenas along with the elements so containers from any two arenas
+	//can be swapped.
+	template<typename T>
+	class ArenaAllocator
+	{
+	public:
+		typedef T value_type;
+		typedef std::false_type propagate_on_container_copy_assignment;
+		typedef std::false_type propagate_on_container_move_assignment;
+		typedef std::true_type propagate_on_container_swap;
+		typedef std::false_type is_always_equal;
+
+		ArenaAllocator() : arena(ModelArena::current()) { }
+		template<typename U>
+		ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) { }
+
+		T* allocate(std::size_t count)
+		{
+			if (arena)
+				return static_cast<T*>(arena->allocate(count * sizeof(T), alignof(T)));
+			return static_cast<T*>(::operator new(count * sizeof(T)));
+		}
+
+		void deallocate(T* p, std::size_t)
+		{
+			if (!arena)
+				::operator delete(p);
+		}
+
+		ArenaAllocator select_on_container_copy_construction() const { return ArenaAllocator(); }
+
+		ModelArena* arena;
+	};
+
+	template<typename T, typename U>
+	inline bool operator==(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs) { return lhs.arena == rhs.arena; }
+	template<typename T, typename U>
+	inline bool operator!=(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs) { return lhs.arena != rhs.arena; }
+
+	//allocated from the current arena when there is one, deleting an object in an arena runs its
+	//destructor but its memory is only released with the arena
+	class ArenaObject
+	{
+	public:
+		static void* operator new(std::size_t size);
+		static void operator delete(void* p);
+	};
+}
+
+//store the text in the KML model as UTF-8 instead of UTF-16, text is only converted where
+//it is passed to or read from Xerces
+#ifdef KML_UTF8_MODEL
+typedef char kml_char;
+#define _K(text) text
+#else
+typedef xerces_char kml_char;
+#define _K(text) _X(text)
+#endif
+typedef std::basic_string<kml_char, std::char_traits<kml_char>, KML::Internal::ArenaAllocator<kml_char>> kml_string;
+typedef std::basic_string_view<kml_char> kml_string_view;
+template<typename T>
+using kml_vector = std::vector<T, KML::Internal::ArenaAllocator<T>>;
+
 #if __cplusplus<201703L || (GCC_VERSION > NO_GCC && GCC_VERSION < GCC_8)
 namespace kmlFs = std::experimental::filesystem;
 #else
@@ -67,42 +198,360 @@ namespace KML::Internal
 	static std::string utf16_to_utf8(const xerces_string &utf16_string);
 	static xerces_string utf8_to_utf16(const std::string &utf16_string);
 
-	static int stoi(const xerces_string& _Str, size_t *_Idx = 0, int _Base = 10);
-	static double stod(const xerces_string& _Str, size_t *_Idx = 0);
+	static int stoi(const kml_string& _Str, size_t *_Idx = 0, int _Base = 10);
+	static double stod(const kml_string& _Str, size_t *_Idx = 0);
+
+	kml_string xerces_to_kml(const XMLCh* text);
+	kml_string xerces_to_kml(const xerces_string& text);
+
+	//text read from Xerces viewed in the model's encoding, a UTF-8 model transcodes into a heap
+	//buffer so looking the text up never leaves a temporary behind in the current arena
+	class XercesTextView
+	{
+	public:
+		explicit XercesTextView(const XMLCh* text);
+		explicit XercesTextView(const xerces_string& text);
+		XercesTextView(const XercesTextView&) = delete;
+		XercesTextView& operator=(const XercesTextView&) = delete;
+
+		operator kml_string_view() const { return m_view; }
+
+	private:
+#ifdef KML_UTF8_MODEL
+		std::string m_text;
+#endif
+		kml_string_view m_view;
+	};
+	xerces_string kml_to_xerces(const kml_string& text);
+	std::string kml_to_utf8(const kml_string& text);
+	kml_string utf8_to_kml(const std::string& text);
+
+	//ISO8601 with a UTC designator or offset as seconds since 1970 UTC, false if WTime has to parse it
+	bool parseIso8601(const kml_char* text, std::size_t length, std::int64_t& seconds);
+	//YYYY-MM-DD HH:MM:SS as wall clock seconds since 1970, false if WTime has to parse it
+	bool parseDateTime(const kml_char* text, std::size_t length, std::int64_t& seconds);
+	//writes the 19 characters of YYYY-MM-DDTHH:MM:SS, the buffer isn't null terminated
+	void formatDateTime(std::int64_t seconds, kml_char* buffer);
+
+	enum class KmlTag : std::uint8_t
+	{
+		Unknown,
+		Kml,
+		Document,
+		Name,
+		NetworkLink,
+		Link,
+		Href,
+		Folder,
+		Schema,
+		SimpleField,
+		Placemark,
+		Style,
+		ExtendedData,
+		Polygon,
+		MultiGeometry,
+		LineString,
+		TimeStamp,
+		When,
+		LineStyle,
+		PolyStyle,
+		Color,
+		Fill,
+		SchemaData,
+		SimpleData,
+		OuterBoundaryIs,
+		LinearRing,
+		Coordinates,
+		Entry
+	};
+
+	//case insensitive, Unknown if the name isn't one of the tags that are read
+	KmlTag lookupTag(const XMLCh* name);
+
+	//checks the node type instead of using RTTI
+	inline xercesc::DOMElement* asElement(xercesc::DOMNode* node)
+	{
+		if (node && node->getNodeType() == xercesc::DOMNode::ELEMENT_NODE)
+			return static_cast<xercesc::DOMElement*>(node);
+		return nullptr;
+	}
+
+	//the element children of a node along with their tags, any other nodes are skipped
+	class ElementChildren
+	{
+	public:
+		struct Child
+		{
+			xercesc::DOMElement* element;
+			KmlTag tag;
+		};
+
+		class iterator
+		{
+		public:
+			explicit iterator(xercesc::DOMNode* node) : m_node(nextElement(node)) { }
+
+			Child operator*() const { return { static_cast<xercesc::DOMElement*>(m_node), lookupTag(m_node->getNodeName()) }; }
+			iterator& operator++() { m_node = nextElement(m_node->getNextSibling()); return *this; }
+			bool operator==(const iterator& other) const { return m_node == other.m_node; }
+			bool operator!=(const iterator& other) const { return m_node != other.m_node; }
+
+		private:
+			xercesc::DOMNode* m_node;
+		};
+
+		explicit ElementChildren(xercesc::DOMNode* parent) : m_parent(parent) { }
+
+		iterator begin() const { return iterator(m_parent ? m_parent->getFirstChild() : nullptr); }
+		iterator end() const { return iterator(nullptr); }
+
+		//null if there isn't a child with the tag
+		xercesc::DOMElement* find(KmlTag tag) const;
+
+	private:
+		static xercesc::DOMNode* nextElement(xercesc::DOMNode* node)
+		{
+			while (node && node->getNodeType() != xercesc::DOMNode::ELEMENT_NODE)
+				node = node->getNextSibling();
+			return node;
+		}
+
+		xercesc::DOMNode* m_parent;
+	};
+
+	//equal strings from the same table share one copy so handles are compared by pointer
+	class InternedString
+	{
+	public:
+		InternedString() : m_value(&emptyString()) { }
+
+		operator const kml_string&() const { return *m_value; }
+		const kml_string& str() const { return *m_value; }
+		const kml_char* c_str() const { return m_value->c_str(); }
+		std::size_t length() const { return m_value->length(); }
+
+		bool operator==(const InternedString& other) const { return m_value == other.m_value; }
+		bool operator!=(const InternedString& other) const { return m_value != other.m_value; }
+
+	private:
+		explicit InternedString(const kml_string* value) : m_value(value) { }
+		static const kml_string& emptyString();
+
+		const kml_string* m_value;
+
+		friend class StringTable;
+	};
+
+	//a model's table is owned by its arena, an output model interns into the table of its input and
+	//several output models can be built at once so interning is locked
+	class StringTable
+	{
+	public:
+		StringTable();
+		StringTable(const StringTable&) = delete;
+		StringTable& operator=(const StringTable&) = delete;
+
+		InternedString intern(kml_string_view text);
+
+	private:
+		std::mutex m_mutex;
+		std::deque<kml_string, ArenaAllocator<kml_string>> m_storage;
+		std::unordered_map<kml_string_view, const kml_string*, std::hash<kml_string_view>, std::equal_to<kml_string_view>,
+			ArenaAllocator<std::pair<const kml_string_view, const kml_string*>>> m_lookup;
+	};
+
+	//interned in the table of the current arena and kept until the arena is released, throws
+	//std::logic_error when no arena is current
+	InternedString intern(kml_string_view text);
+
+	class DeflatePool;
+
+	//raw deflate data for one block of a stream with the checksum and length of the text it holds
+	struct DeflateBlock
+	{
+		std::vector<std::uint8_t> data;
+		unsigned long crc;
+		std::size_t length;
+	};
 
-	class Coordinates
+	//compresses a stream into raw deflate data on a pool of threads the way pigz does, each block is
+	//primed with the end of the one before it and the blocks are passed to output in order
+	class ParallelDeflate
+	{
+	public:
+		typedef std::function<void(const std::uint8_t* data, std::size_t length)> Output;
+
+		ParallelDeflate(std::int32_t level, std::uint32_t threads, Output output);
+		ParallelDeflate(const ParallelDeflate&) = delete;
+		ParallelDeflate& operator=(const ParallelDeflate&) = delete;
+		virtual ~ParallelDeflate();
+
+		void write(const std::uint8_t* data, std::size_t length);
+		//compresses what is left and ends the stream
+		void finish();
+		//of the text written so far
+		unsigned long crc() const { return m_crc; }
+		std::uint64_t length() const { return m_length; }
+
+	private:
+		void submitBlock(bool last);
+		void writeBlock();
+
+		std::int32_t m_level;
+		Output m_output;
+		std::unique_ptr<DeflatePool> m_pool;
+		std::vector<std::uint8_t> m_block;
+		std::vector<std::uint8_t> m_dictionary;
+		std::deque<std::future<DeflateBlock>> m_pending;
+		unsigned long m_crc;
+		std::uint64_t m_length;
+	};
+
+	class MappedFile
+	{
+	public:
+		explicit MappedFile(const kmlFs::path& path);
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+		virtual ~MappedFile();
+
+		bool isOpen() const { return data != nullptr; }
+
+		const XMLByte* data;
+		std::size_t size;
+
+#ifdef _MSC_VER
+	private:
+		void* m_file;
+		void* m_mapping;
+#endif
+	};
+
+	class CoordinateTuples;
+
+	//writes UTF-8 straight into a format target without building a DOM, the output matches DOMLSSerializer
+	class KmlWriter
+	{
+	public:
+		//coordinatePrecision is the number of decimal places to round coordinates to, -1 leaves them as they are
+		explicit KmlWriter(xercesc::XMLFormatTarget* target, bool prettyPrint = true, bool normalizeLists = false, std::int32_t coordinatePrecision = -1);
+		KmlWriter(const KmlWriter&) = delete;
+		KmlWriter& operator=(const KmlWriter&) = delete;
+		virtual ~KmlWriter();
+
+		void startDocument();
+		void endDocument();
+		void startElement(const xerces_char* name);
+		void endElement();
+		void attribute(const xerces_char* name, const kml_string& value);
+		void text(const kml_string& value);
+		void textElement(const xerces_char* name, const kml_string& value);
+		//the text is already escaped UTF-8, its line ends are written as LF
+		void escapedTextElement(const xerces_char* name, const char* text, std::size_t length);
+		//a whitespace separated list, like coordinates
+		void listElement(const xerces_char* name, const kml_string& value);
+		void escapedListElement(const xerces_char* name, const char* text, std::size_t length);
+		//lon,lat[,alt] tuples, rounded if there is a coordinate precision
+		void coordinateElement(const xerces_char* name, const kml_string& value);
+		void escapedCoordinateElement(const xerces_char* name, const char* text, std::size_t length);
+		//parsed tuples as the shortest text that reads back, or rounded if there is a coordinate precision
+		void tupleElement(const xerces_char* name, const CoordinateTuples& tuples);
+		void flush();
+
+	private:
+		struct OpenElement
+		{
+			const xerces_char* name;
+			bool hasChildren;
+		};
+
+		void closeStartTag();
+		void newLine(std::size_t depth);
+		void appendName(const xerces_char* name);
+		void appendEscaped(const kml_string& value, bool isAttribute);
+
+		xercesc::XMLFormatTarget* m_target;
+		bool m_prettyPrint;
+		bool m_normalizeLists;
+		std::int32_t m_coordinatePrecision;
+		bool m_startTagOpen;
+		std::string m_buffer;
+		//scratch space for normalizing lists
+		std::string m_asciiList;
+		kml_string m_list;
+		//scratch space for rounding coordinates, on the heap so it doesn't grow the model's arena
+		CoordinateTuples* m_tuples;
+		std::vector<OpenElement> m_elements;
+	};
+
+	//the numeric form of a coordinate list, only built when something asks for it
+	class CoordinateTuples : public ArenaObject
+	{
+	public:
+		CoordinateTuples();
+		void clear();
+
+		kml_vector<double> longitude;
+		kml_vector<double> latitude;
+		//zero for any tuple without an altitude
+		kml_vector<double> altitude;
+		//did any of the tuples have an altitude
+		bool hasAltitude;
+	};
+
+	class Coordinates : public ArenaObject
 	{
 	public:
 		explicit Coordinates(xercesc::DOMNode* elem);
+		Coordinates();
 		Coordinates(const Coordinates& other);
+		virtual ~Coordinates();
+		//written from tuples once they have been parsed, so changes to the numbers are saved
 		void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
-
-		xerces_string value;
+		void write(KmlWriter& writer) const;
+		//fills tuples, false and tuples left null if the text isn't a valid coordinate list
+		bool parse();
+		//replaces value with the shortest text that reads back as tuples
+		void format();
+		//the text of the tuples when they have been parsed, otherwise the text in value or referenced in the input
+		kml_string text() const;
+
+		kml_string value;
+		//ASCII text in the mapped input when geometry is passed through, value is empty when it is set.
+		//It can have CRLF line ends, they are written as the LF the parser read.
+		const char* raw;
+		std::size_t rawLength;
+		//null until the list is parsed
+		CoordinateTuples* tuples;
 	};
 
-	class LinearRing
+	class LinearRing : public ArenaObject
 	{
 	public:
 		explicit LinearRing(xercesc::DOMNode* elem);
+		LinearRing();
 		LinearRing(const LinearRing& other);
 		virtual ~LinearRing();
 		void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
+		void write(KmlWriter& writer) const;
 
 		Coordinates* coordinates;
 	};
 
-	class OuterBoundaryIs
+	class OuterBoundaryIs : public ArenaObject
 	{
 	public:
 		explicit OuterBoundaryIs(xercesc::DOMNode* elem);
+		OuterBoundaryIs();
 		OuterBoundaryIs(const OuterBoundaryIs& other);
 		virtual ~OuterBoundaryIs();
 		void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
+		void write(KmlWriter& writer) const;
 
 		LinearRing* linearRing;
 	};
 
-	class LineString
+	class LineString : public ArenaObject
 	{
 	public:
 		explicit LineString(xercesc::DOMNode* elem);
@@ -110,69 +559,66 @@ namespace KML::Internal
 		LineString(const LineString& other);
 		virtual ~LineString();
 		void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
+		void write(KmlWriter& writer) const;
 
 		Coordinates* coordinates;
 	};
 
-	class Polygon
+	class Polygon : public ArenaObject
 	{
 	public:
 		explicit Polygon(xercesc::DOMNode* elem);
+		Polygon();
 		Polygon(const Polygon& other);
 		virtual ~Polygon();
 		void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
+		void write(KmlWriter& writer) const;
 
 		OuterBoundaryIs* outerBoundaryIs;
 	};
 
-	class PolyStyle
+	class PolyStyle : public ArenaObject
 	{
 	public:
 		explicit PolyStyle(xercesc::DOMNode* elem);
 		PolyStyle();
 		PolyStyle(const PolyStyle& other);
 		void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
+		void write(KmlWriter& writer) const;
 
-		xerces_string fill;
+		InternedString fill;
 	};
 
-	class SimpleData
-	{
-	public:
-		explicit SimpleData(xercesc::DOMNode* elem);
-		SimpleData(const SimpleData& other);
-		void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
-
-		xerces_string name;
-		xerces_string value;
-	};
-
-	class SimpleField
+	class SimpleField : public ArenaObject
 	{
 	public:
 		explicit SimpleField(xercesc::DOMNode* elem);
+		SimpleField();
 		SimpleField(const SimpleField& other);
 		void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
+		void write(KmlWriter& writer) const;
 
-		xerces_string name;
-		xerces_string type;
+		kml_string name;
+		InternedString type;
 	};
 
 	namespace Input
 	{
-		class InputLineStyle
+		class InputLineStyle : public ArenaObject
 		{
 		public:
 			explicit InputLineStyle(xercesc::DOMNode* elem);
+			InputLineStyle();
 			void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
 
-			xerces_string color;
+			InternedString color;
 		};
 
-		class InputStyle
+		class InputStyle : public ArenaObject
 		{
 		public:
 			explicit InputStyle(xercesc::DOMNode* elem);
+			InputStyle();
 			virtual ~InputStyle();
 			void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
 
@@ -180,213 +626,436 @@ namespace KML::Internal
 			PolyStyle* polyStyle;
 		};
 
-		class InputSchemaData
+		class InputSchema;
+
+		//the SimpleData of a folder, a column for each field and a row for each placemark
+		class InputDataTable
+		{
+		public:
+			//fields read by the output instead of being written as data, matched in any case
+			enum class Role : std::uint8_t
+			{
+				None,
+				Width,
+				Color,
+				Timestamp,
+				Count
+			};
+
+			struct Column
+			{
+				kml_string name;
+				Role role;
+				//only valid where present is set
+				kml_vector<InternedString> values;
+				kml_vector<bool> present;
+			};
+
+			static constexpr std::uint32_t npos = static_cast<std::uint32_t>(-1);
+
+			InputDataTable();
+
+			//in the schema's order
+			void addFields(const InputSchema* schema);
+			//names are matched exactly so they are written back with the same spelling, hint is checked first
+			std::uint32_t column(kml_string_view name, std::size_t hint);
+			//the next column with the same name, added if there isn't one, for a field repeated in one placemark
+			std::uint32_t duplicate(std::uint32_t column);
+			std::size_t addRow() { return m_rows++; }
+
+			//false if the row already has a value for the column
+			bool set(std::size_t row, std::uint32_t column, kml_string_view value);
+			//null if the row doesn't have a value for the column
+			const InternedString* value(std::size_t row, std::uint32_t column) const;
+
+			void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent, std::size_t row, std::uint32_t column) const;
+			void write(KmlWriter& writer, std::size_t row, std::uint32_t column) const;
+
+			kml_vector<Column> columns;
+
+		private:
+			std::size_t m_rows;
+		};
+
+		//a placemark's SchemaData, its values are a row of the folder's table
+		class InputSchemaData : public ArenaObject
 		{
 		public:
-			explicit InputSchemaData(xercesc::DOMNode* elem);
-			virtual ~InputSchemaData();
+			InputSchemaData(xercesc::DOMNode* elem, InputDataTable* table);
+			explicit InputSchemaData(InputDataTable* table);
 			void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
 
-			xerces_string schemaUrl;
-			std::vector<SimpleData*> simpleData;
+			//every value is kept, even when a placemark repeats a field
+			void setValue(kml_string_view name, kml_string_view value);
+			//the first TIMESTAMP is used but the last WIDTH and COLOR, null if there isn't one
+			const InternedString* value(InputDataTable::Role role) const;
+
+			kml_string schemaUrl;
+			InputDataTable* table;
+			std::size_t row;
+			//in the order they were read
+			kml_vector<std::uint32_t> columns;
 		};
 
-		class InputExtendedData
+		class InputExtendedData : public ArenaObject
 		{
 		public:
-			explicit InputExtendedData(xercesc::DOMNode* elem);
+			InputExtendedData(xercesc::DOMNode* elem, InputDataTable* table);
+			InputExtendedData();
 			virtual ~InputExtendedData();
 			void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
 
 			InputSchemaData* schemaData;
 		};
 
-		class InputPlacemark
+		class InputPlacemark : public ArenaObject
 		{
 		public:
-			explicit InputPlacemark(xercesc::DOMNode* elem);
+			InputPlacemark(xercesc::DOMNode* elem, InputDataTable* table);
+			InputPlacemark();
 			virtual ~InputPlacemark();
 			void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
 
-			xerces_string name;
+			kml_string name;
 			InputStyle* style;
 			InputExtendedData* extendedData;
-			std::vector<Polygon*> polygons;
+			kml_vector<Polygon*> polygons;
 			LineString* lineString;
-			InputPlacemark* _next;
-			xerces_string time;
+			kml_string time;
 		};
 
-		class InputSchema
+		class InputSchema : public ArenaObject
 		{
 		public:
 			explicit InputSchema(xercesc::DOMNode* elem);
+			InputSchema();
 			virtual ~InputSchema();
 			void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
 
-			xerces_string id;
-			xerces_string name;
-			std::vector<SimpleField*> simpleField;
+			kml_string id;
+			kml_string name;
+			kml_vector<SimpleField*> simpleField;
 		};
 
-		class InputFolder
+		class InputFolder : public ArenaObject
 		{
 		public:
 			explicit InputFolder(xercesc::DOMNode* elem);
-			explicit InputFolder(const xerces_string& name);
+			explicit InputFolder(const kml_string& name);
 			virtual ~InputFolder();
 			void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
 
 			void parsePlacemark(xercesc::DOMNode* node);
 
-			xerces_string name;
+			kml_string name;
 			InputSchema* schema;
-			std::vector<InputPlacemark*> placemark;
+			kml_vector<InputPlacemark*> placemark;
+			InputDataTable data;
 		};
 
-		class InputDocument
+		class InputDocument : public ArenaObject
 		{
 		public:
 			explicit InputDocument(xercesc::DOMNode* elem);
+			InputDocument();
 			virtual ~InputDocument();
 			void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
 
-			xerces_string id;
+			kml_string id;
 			InputFolder* folder;
 			InputSchema* schema;
-			xerces_string link;
+			kml_string link;
 		};
 
 		class InputKmlFile
 		{
 		public:
-			explicit InputKmlFile(kmlFs::path input);
+			//streaming builds the model from SAX2 events, passthrough references coordinate text in the mapped input
+			explicit InputKmlFile(kmlFs::path input, bool streaming = false, bool passthrough = false);
 			virtual ~InputKmlFile();
-			bool save(kmlFs::path output);
+			bool save(kmlFs::path output, const KmlOutputOptions& options = KmlOutputOptions());
+			//the arena the model was read into
+			ModelArena* arena() const { return m_arena; }
 
-			xerces_string ns;
+			kml_string ns;
 			InputDocument* document;
 
 		protected:
-			bool initialize(const kmlFs::path& input, const std::string& kmzPath);
+			bool initialize(const kmlFs::path& input, const std::string& kmzPath, bool streaming, bool passthrough);
+
+		private:
+			ModelArena* m_arena;
+			//has to outlive the model when coordinates reference it
+			MappedFile* m_source;
+		};
+
+		//builds the input model from SAX2 events so the input DOM is never held in memory
+		class InputKmlHandler : public xercesc::DefaultHandler
+		{
+		public:
+			//source is the mapped input when coordinate text should reference it
+			explicit InputKmlHandler(InputKmlFile* file, const MappedFile* source = nullptr);
+
+			void startElement(const XMLCh* const uri, const XMLCh* const localname, const XMLCh* const qname, const xercesc::Attributes& attrs) override;
+			void endElement(const XMLCh* const uri, const XMLCh* const localname, const XMLCh* const qname) override;
+			void characters(const XMLCh* const chars, const XMLSize_t length) override;
+
+		private:
+			enum class Element : std::uint8_t
+			{
+				Ignore,
+				Kml,
+				Document,
+				DocumentName,
+				NetworkLink,
+				Link,
+				Href,
+				Folder,
+				FolderName,
+				Schema,
+				Placemark,
+				PlacemarkName,
+				TimeStamp,
+				When,
+				Style,
+				LineStyle,
+				Color,
+				PolyStyle,
+				Fill,
+				ExtendedData,
+				SchemaData,
+				SimpleData,
+				MultiGeometry,
+				Polygon,
+				OuterBoundaryIs,
+				LinearRing,
+				LineString,
+				Coordinates
+			};
+
+			struct Frame
+			{
+				Element element;
+				bool childFound;
+			};
+
+			Element childElement(Frame& parent, KmlTag tag, const xercesc::Attributes& attrs);
+
+			InputKmlFile* m_file;
+			std::vector<Frame> m_stack;
+			xerces_string m_text;
+			std::size_t m_textDepth;
+			kml_string m_localName;
+
+			InputDocument* m_document;
+			InputFolder* m_folder;
+			InputSchema* m_schema;
+			InputPlacemark* m_placemark;
+			InputStyle* m_style;
+			InputSchemaData* m_schemaData;
+			xerces_string m_dataName;
+			Polygon* m_polygon;
+			LinearRing* m_linearRing;
+			LineString* m_lineString;
+			Coordinates* m_coordinates;
+
+			const char* m_sourceCursor;
+			const char* m_sourceEnd;
+			//null if the coordinates weren't found in the mapped input
+			const char* m_rawBegin;
+			const char* m_rawEnd;
 		};
 	}
 
 	namespace Output
 	{
-		class OutputLineStyle
+		//shared by every placemark output with an offset so the manager is only set up once
+		class OutputTimeContext
+		{
+		public:
+			explicit OutputTimeContext(const HSS_Time::WTimeSpan& offset);
+			OutputTimeContext(const OutputTimeContext&) = delete;
+			OutputTimeContext& operator=(const OutputTimeContext&) = delete;
+
+			//from the TimeStamp or the TIMESTAMP data, false if the placemark doesn't have a time
+			bool parse(const Input::InputPlacemark* placemark, HSS_Time::WTime& time) const;
+			//seconds since 1970 UTC, false if WTime has to parse the time
+			bool parseSeconds(const Input::InputPlacemark* placemark, std::int64_t& seconds, bool& hasTime);
+			//each distinct time is only formatted once
+			const kml_string& format(const HSS_Time::WTime& time);
+			kml_string formatSeconds(std::int64_t seconds) const;
+
+			HSS_Time::WorldLocation location;
+			HSS_Time::WTimeManager manager;
+
+		private:
+			//checks WTime agrees with the fast path and learns the suffix it writes for the offset
+			bool calibrate(const kml_string& text, std::uint32_t flags, std::int64_t seconds);
+
+			std::unordered_map<std::uint64_t, kml_string> m_formatted;
+			std::int64_t m_offset;
+			bool m_fastPath;
+			bool m_isoChecked;
+			bool m_localChecked;
+			kml_string m_suffix;
+		};
+
+		class OutputLineStyle : public ArenaObject
 		{
 		public:
 			explicit OutputLineStyle(Input::InputLineStyle* style);
 			OutputLineStyle();
-			void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
+			void write(KmlWriter& writer) const;
 
-			xerces_string color;
+			InternedString color;
 			std::int32_t width;
 		};
 
-		class OutputStyle
+		class OutputStyle : public ArenaObject
 		{
 		public:
 			explicit OutputStyle(Input::InputStyle* style);
 			OutputStyle();
 			virtual ~OutputStyle();
-			void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
+			void write(KmlWriter& writer) const;
 
 			OutputLineStyle* lineStyle;
 			PolyStyle* polyStyle;
 		};
 
-		class OutputSchemaData
+		class OutputFolder;
+
+		//each distinct style of a folder is written once and referenced with a styleUrl
+		class OutputStyleTable
+		{
+		public:
+			explicit OutputStyleTable(const OutputFolder* folder);
+			void write(KmlWriter& writer) const;
+
+			const kml_string& url(const OutputStyle* style) const;
+
+		private:
+			struct Key
+			{
+				const OutputStyle* style;
+
+				bool operator==(const Key& other) const;
+			};
+
+			struct KeyHash
+			{
+				std::size_t operator()(const Key& key) const;
+			};
+
+			std::unordered_map<Key, std::size_t, KeyHash> m_index;
+			std::vector<const OutputStyle*> m_styles;
+			std::vector<kml_string> m_urls;
+		};
+
+		class OutputSchemaData : public ArenaObject
 		{
 		public:
 			explicit OutputSchemaData(Input::InputSchemaData* data);
 			virtual ~OutputSchemaData();
-			void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
+			void write(KmlWriter& writer) const;
 
-			xerces_string schemaUrl;
-			std::vector<SimpleData*> simpleData;
+			kml_string schemaUrl;
+			const Input::InputDataTable* table;
+			std::size_t row;
+			kml_vector<std::uint32_t> columns;
 		};
 
-		class OutputExtendedData
+		class OutputExtendedData : public ArenaObject
 		{
 		public:
 			explicit OutputExtendedData(Input::InputExtendedData* data);
 			virtual ~OutputExtendedData();
-			void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
+			void write(KmlWriter& writer) const;
 
 			OutputSchemaData* schemaData;
 		};
 
-		class OutputTimeSpan
+		class OutputTimeSpan : public ArenaObject
 		{
 		public:
-			explicit OutputTimeSpan(xerces_string start, xerces_string end);
-			void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
+			explicit OutputTimeSpan(const kml_string& start, const kml_string& end);
+			void write(KmlWriter& writer) const;
 
-			xerces_string begin;
-			xerces_string end;
+			kml_string begin;
+			kml_string end;
 		};
 
-		class OutputPlacemark
+		class OutputPlacemark : public ArenaObject
 		{
 		public:
-			explicit OutputPlacemark(Input::InputPlacemark* placemark, const HSS_Time::WTimeSpan& offset);
+			explicit OutputPlacemark(Input::InputPlacemark* placemark);
 			virtual ~OutputPlacemark();
-			void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
+			//null styles writes the style in the placemark
+			void write(KmlWriter& writer, const OutputStyleTable* styles = nullptr) const;
+			void setTimeSpan(const kml_string& start, const kml_string& end);
 
-			xerces_string name;
+			kml_string name;
 			OutputStyle* style;
 			OutputExtendedData* extendedData;
-			std::vector<Polygon*> polygons;
-			LineString* lineString;
+			kml_vector<const Polygon*> polygons;
+			const LineString* lineString;
 			OutputTimeSpan* timeSpan;
 		};
 
-		class OutputSchema
+		class OutputSchema : public ArenaObject
 		{
 		public:
 			explicit OutputSchema(Input::InputSchema* schema);
 			virtual ~OutputSchema();
-			void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
+			void write(KmlWriter& writer) const;
 
-			xerces_string id;
-			xerces_string name;
-			std::vector<SimpleField*> simpleField;
+			kml_string id;
+			kml_string name;
+			kml_vector<const SimpleField*> simpleField;
 		};
 
-		class OutputFolder
+		class OutputFolder : public ArenaObject
 		{
 		public:
-			explicit OutputFolder(Input::InputFolder* folder, const HSS_Time::WTimeSpan& offset);
+			explicit OutputFolder(Input::InputFolder* folder);
 			virtual ~OutputFolder();
-			void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
+			void write(KmlWriter& writer, const OutputStyleTable* styles = nullptr) const;
+			void applyOffset(Input::InputFolder* folder, OutputTimeContext& context);
 
-			xerces_string name;
+			kml_string name;
 			OutputSchema* schema;
-			std::vector<OutputPlacemark*> placemark;
+			kml_vector<OutputPlacemark*> placemark;
 		};
 
-		class OutputDocument
+		class OutputDocument : public ArenaObject
 		{
 		public:
-			explicit OutputDocument(Input::InputDocument* document, const HSS_Time::WTimeSpan& offset);
+			explicit OutputDocument(Input::InputDocument* document);
 			virtual ~OutputDocument();
-			void save(xercesc::DOMDocument* document, xercesc::DOMElement* parent);
+			void write(KmlWriter& writer, bool sharedStyles = false) const;
+			void applyOffset(Input::InputDocument* document, OutputTimeContext& context);
 
-			xerces_string id;
+			kml_string id;
 			OutputFolder* folder;
 			OutputSchema* schema;
 		};
 
+		//geometry and data that don't change are shared with the input file so it has to outlive the output
 		class OutputKmlFile
 		{
 		public:
 			explicit OutputKmlFile(const KML::Internal::Input::InputKmlFile* input, const HSS_Time::WTimeSpan& offset);
-			virtual bool save(kmlFs::path output);
+			virtual ~OutputKmlFile();
+			//rebuilds only what depends on the offset, input has to be the file this was built from
+			void applyOffset(const KML::Internal::Input::InputKmlFile* input, const HSS_Time::WTimeSpan& offset);
+			//doesn't modify the output so several files can be written at once
+			virtual bool save(kmlFs::path output, const KmlOutputOptions& options = KmlOutputOptions(), KmlOutputFormat format = KmlOutputFormat::Auto) const;
 
-			xerces_string ns;
+			kml_string ns;
 			OutputDocument* document;
+
+		private:
+			ModelArena* m_arena;
 		};
 	}
 }
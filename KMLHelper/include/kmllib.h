@@ -23,6 +23,8 @@
 #include "WTime.h"
 #include "kmllib_cfg.h"
 
+#include <vector>
+
 namespace kmlFs = fs;
 
 
@@ -32,6 +34,93 @@ namespace KML
 	{
 		class InputKmlFile;
 	}
+	/// <summary>
+	/// Options that control how the input KML file is read.
+	/// </summary>
+	struct KmlInputOptions
+	{
+		/// <summary>
+		/// Build the input model directly while the file is being read instead of parsing it
+		/// into a DOM first. Lowers the peak memory used for large input files.
+		/// </summary>
+		bool streaming = false;
+		/// <summary>
+		/// Keep the coordinate text of a streamed .kml file as a reference into the memory mapped
+		/// input and copy those bytes to the output unchanged instead of decoding and re-encoding
+		/// them. Only used with <see cref="streaming"/>, KMZ entries are inflated while they are read
+		/// so there are no input bytes to reference. The parser still decodes the text to UTF-16 to
+		/// check it against the input, this saves the copy in the model and the encoding on output,
+		/// not the decoding.
+		/// </summary>
+		bool passthroughGeometry = false;
+	};
+
+	/// <summary>
+	/// Options that control how the processed KML file is written.
+	/// </summary>
+	struct KmlOutputOptions
+	{
+		/// <summary>
+		/// The zlib compression level, 0 to 9, used for KMZ output. -1 uses zlib's default level.
+		/// </summary>
+		std::int32_t compressionLevel = 9;
+		/// <summary>
+		/// The number of threads used to compress KMZ output. With more than one thread the
+		/// document is split into blocks that are deflated in parallel.
+		/// </summary>
+		std::uint32_t compressionThreads = 1;
+		/// <summary>
+		/// Write each distinct placemark style once under the document and reference it from the
+		/// placemarks with a styleUrl instead of writing a copy of the style in every placemark.
+		/// </summary>
+		bool sharedStyles = false;
+		/// <summary>
+		/// Indent the output with a new line for every element. Compact output leaves out all of the
+		/// whitespace between elements.
+		/// </summary>
+		bool prettyPrint = true;
+		/// <summary>
+		/// Collapse the whitespace between coordinate tuples to a single space and trim it from the
+		/// ends of each coordinate list. Only applies to processed output.
+		/// </summary>
+		bool normalizeCoordinates = false;
+		/// <summary>
+		/// The number of decimal places, up to 15, to round longitudes, latitudes, and altitudes to,
+		/// or -1 to write coordinates as they are. 7 decimal places is about a centimetre. Only
+		/// applies to processed output.
+		/// </summary>
+		std::int32_t coordinatePrecision = -1;
+	};
+
+	/// <summary>
+	/// The format to write a processed KML file in.
+	/// </summary>
+	enum class KmlOutputFormat
+	{
+		/// <summary>
+		/// Use the extension of the output path, .kmz for a KMZ file and KML otherwise.
+		/// </summary>
+		Auto,
+		Kml,
+		Kmz
+	};
+
+	/// <summary>
+	/// A file to write when processing several outputs at once.
+	/// </summary>
+	struct KmlOutputTarget
+	{
+		/// <summary>
+		/// The location to write the processed KML file to. Will be overwritten if it exists.
+		/// </summary>
+		kmlFs::path path;
+		/// <summary>
+		/// The timezone offset to write to the output file.
+		/// </summary>
+		HSS_Time::WTimeSpan offset;
+		KmlOutputFormat format = KmlOutputFormat::Auto;
+	};
+
 	class KML_LIB_API KmlHelper
 	{
 	public:
@@ -41,6 +130,14 @@ namespace KML
 		/// </summary>
 		/// <param name="input">The location of the KML file to parse.</param>
 		explicit KmlHelper(const kmlFs::path& input);
+
+		/// <summary>
+		/// Initialize the helper class with an input KML file. <paramref name="input"/> must
+		/// reference an existing file that conforms to the expected KML format.
+		/// </summary>
+		/// <param name="input">The location of the KML file to parse.</param>
+		/// <param name="options">Options that control how the input file is read.</param>
+		KmlHelper(const kmlFs::path& input, const KmlInputOptions& options);
 		virtual ~KmlHelper();
 
 		/// <summary>
@@ -56,6 +153,26 @@ namespace KML
 		/// <param name="timezone">The timezone offset to write to the output file.</param>
 		bool process(const kmlFs::path& output, const HSS_Time::WTimeSpan& offset);
 
+		/// <summary>
+		/// Process the input KML file and write the results to a file.
+		/// </summary>
+		/// <param name="output">The location to write the processed KML file to. Will be overwritten if it exists.</param>
+		/// <param name="timezone">The timezone offset to write to the output file.</param>
+		/// <param name="options">Options that control how the output file is written.</param>
+		bool process(const kmlFs::path& output, const HSS_Time::WTimeSpan& offset, const KmlOutputOptions& options);
+
+		/// <summary>
+		/// Process the input KML file and write the results to several files. The files are written at the
+		/// same time, by at most one thread per hardware thread divided by
+		/// <see cref="KmlOutputOptions.compressionThreads"/>. Each thread builds its own output once and
+		/// only rebuilds the parts that depend on the timezone offset when it moves to a target with a
+		/// different offset, targets are grouped by offset in the order each offset first appears.
+		/// </summary>
+		/// <param name="targets">The files to write.</param>
+		/// <param name="options">Options that control how the output files are written.</param>
+		/// <returns>False if any file could not be written, <see cref="GetErrors()"/> counts the files that failed.</returns>
+		bool process(const std::vector<KmlOutputTarget>& targets, const KmlOutputOptions& options);
+
 		/// <summary>
 		/// Get an indicator of any errors that occurred while processing the KML file.
 		/// </summary>
@@ -0,0 +1,770 @@
+/**
+ * WISE_Processing_Lib: kmltests.cpp
+ * Copyright (C) 2023  WISE
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "kmlinternal.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+using namespace KML::Internal;
+using namespace KML::Internal::Input;
+using namespace KML::Internal::Output;
+
+
+static int s_failures = 0;
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) \
+		{ \
+			std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+			s_failures++; \
+		} \
+	} while (0)
+
+//collects everything written to it so the output can be compared
+class StringTarget : public xercesc::XMLFormatTarget
+{
+public:
+	void writeChars(const XMLByte* const toWrite, const XMLSize_t count, xercesc::XMLFormatter* const) override
+	{
+		text.append(reinterpret_cast<const char*>(toWrite), count);
+	}
+
+	std::string text;
+};
+
+
+static void testArenaAllocator()
+{
+	ModelArena first;
+	ModelArena second;
+	//long enough that the text isn't stored in the string itself
+	const kml_char* longText = _K("a name long enough to be allocated from the arena");
+	auto make = [longText](ModelArena* arena) { ModelArena::Scope scope(arena); return kml_string(longText); };
+
+	//swapping exchanges the arenas with the elements
+	kml_string a = make(&first);
+	kml_string b = make(&second);
+	b += _K(" and more");
+	a.swap(b);
+	CHECK(a.get_allocator().arena == &second);
+	CHECK(b.get_allocator().arena == &first);
+	CHECK(b == longText);
+
+	kml_vector<double> x, y;
+	{
+		ModelArena::Scope scope(&first);
+		x = kml_vector<double>(4, 1.0);
+	}
+	{
+		ModelArena::Scope scope(&second);
+		kml_vector<double> values(8, 2.0);
+		y.swap(values);
+	}
+	CHECK(x.get_allocator().arena == nullptr);
+	CHECK(y.get_allocator().arena == &second);
+	x.swap(y);
+	CHECK(x.get_allocator().arena == &second && x.size() == 8 && x[0] == 2.0);
+	CHECK(y.get_allocator().arena == nullptr && y.size() == 4 && y[0] == 1.0);
+
+	//assigning keeps the target's arena and copies the elements in
+	kml_string target = make(&first);
+	target = make(&second);
+	CHECK(target.get_allocator().arena == &first);
+	CHECK(target == longText);
+	kml_string copied = make(&second);
+	copied = target;
+	CHECK(copied.get_allocator().arena == &second);
+
+	//a copy is made in the arena that is current
+	{
+		ModelArena::Scope scope(&second);
+		kml_string copy(target);
+		CHECK(copy.get_allocator().arena == &second);
+		CHECK(copy == longText);
+	}
+	kml_string heapCopy(target);
+	CHECK(heapCopy.get_allocator().arena == nullptr);
+}
+
+static void testTagLookup()
+{
+	struct { const XMLCh* name; KmlTag tag; } names[] = {
+		{ _X("kml"), KmlTag::Kml },
+		{ _X("Document"), KmlTag::Document },
+		{ _X("name"), KmlTag::Name },
+		{ _X("NetworkLink"), KmlTag::NetworkLink },
+		{ _X("Link"), KmlTag::Link },
+		{ _X("href"), KmlTag::Href },
+		{ _X("Folder"), KmlTag::Folder },
+		{ _X("Schema"), KmlTag::Schema },
+		{ _X("SimpleField"), KmlTag::SimpleField },
+		{ _X("Placemark"), KmlTag::Placemark },
+		{ _X("Style"), KmlTag::Style },
+		{ _X("ExtendedData"), KmlTag::ExtendedData },
+		{ _X("Polygon"), KmlTag::Polygon },
+		{ _X("MultiGeometry"), KmlTag::MultiGeometry },
+		{ _X("LineString"), KmlTag::LineString },
+		{ _X("TimeStamp"), KmlTag::TimeStamp },
+		{ _X("when"), KmlTag::When },
+		{ _X("LineStyle"), KmlTag::LineStyle },
+		{ _X("PolyStyle"), KmlTag::PolyStyle },
+		{ _X("color"), KmlTag::Color },
+		{ _X("fill"), KmlTag::Fill },
+		{ _X("SchemaData"), KmlTag::SchemaData },
+		{ _X("SimpleData"), KmlTag::SimpleData },
+		{ _X("outerBoundaryIs"), KmlTag::OuterBoundaryIs },
+		{ _X("LinearRing"), KmlTag::LinearRing },
+		{ _X("coordinates"), KmlTag::Coordinates },
+		{ _X("entry"), KmlTag::Entry },
+		//names match in any case
+		{ _X("PLACEMARK"), KmlTag::Placemark },
+		{ _X("simpledata"), KmlTag::SimpleData },
+		{ _X(""), KmlTag::Unknown },
+		{ _X("Point"), KmlTag::Unknown },
+		{ _X("kmlx"), KmlTag::Unknown },
+		{ _X("km"), KmlTag::Unknown },
+		{ _X("n\u00e4me"), KmlTag::Unknown },
+	};
+
+	for (auto& name : names)
+		CHECK(lookupTag(name.name) == name.tag);
+}
+
+static void testTranscoders()
+{
+	//long enough to go through the vector path, with every length of UTF-8 sequence
+	const std::string utf8 = "placemark name 0123456789 \xc3\xa9\xc3\xa8 \xe2\x82\xac \xf0\x9f\x94\xa5 done";
+	const xerces_string utf16 = _X("placemark name 0123456789 \u00e9\u00e8 \u20ac \U0001f525 done");
+
+	kml_string text = utf8_to_kml(utf8);
+	CHECK(kml_to_utf8(text) == utf8);
+	CHECK(kml_to_xerces(text) == utf16);
+	CHECK(xerces_to_kml(utf16) == text);
+	CHECK(xerces_to_kml(utf16.c_str()) == text);
+	CHECK(xerces_to_kml(static_cast<const XMLCh*>(nullptr)).empty());
+
+	CHECK(kml_string_view(XercesTextView(utf16)) == kml_string_view(text));
+	CHECK(kml_string_view(XercesTextView(static_cast<const XMLCh*>(nullptr))).empty());
+
+#ifndef KML_UTF8_MODEL
+	//truncated, overlong, and surrogate encodings are all rejected
+	const char* invalid[] = { "\xc3", "\xe2\x82", "\xc0\xaf", "\xed\xa0\x80", "\xf4\x90\x80\x80", "\x80" };
+	for (auto text : invalid)
+	{
+		bool threw = false;
+		try
+		{
+			utf8_to_kml(text);
+		}
+		catch (std::range_error&)
+		{
+			threw = true;
+		}
+		CHECK(threw);
+	}
+#endif
+}
+
+static void testTimes()
+{
+	std::int64_t seconds;
+	kml_string text = _K("2021-06-01T13:00:00-06:00");
+	CHECK(parseIso8601(text.c_str(), text.length(), seconds));
+	CHECK(seconds == 1622574000);
+	text = _K("2021-06-01T19:00:00Z");
+	CHECK(parseIso8601(text.c_str(), text.length(), seconds));
+	CHECK(seconds == 1622574000);
+	text = _K("2021-06-01 13:00:00");
+	CHECK(!parseIso8601(text.c_str(), text.length(), seconds));
+	CHECK(parseDateTime(text.c_str(), text.length(), seconds));
+
+	kml_char buffer[19];
+	formatDateTime(seconds, buffer);
+	CHECK(kml_string(buffer, 19) == _K("2021-06-01T13:00:00"));
+	formatDateTime(-1, buffer);
+	CHECK(kml_string(buffer, 19) == _K("1969-12-31T23:59:59"));
+
+	text = _K("2020-02-29T00:00:00+05:30");
+	CHECK(parseIso8601(text.c_str(), text.length(), seconds));
+	CHECK(seconds == 1582914600);
+	text = _K("2020-02-29T00:00:00-0530");
+	CHECK(parseIso8601(text.c_str(), text.length(), seconds));
+	CHECK(seconds == 1582954200);
+
+	//invalid dates, leap seconds, fractional seconds and odd zones are left for WTime to parse
+	const kml_char* fallback[] = {
+		_K("2021-02-29T00:00:00Z"), _K("2021-04-31T00:00:00Z"), _K("2021-13-01T00:00:00Z"), _K("2021-00-01T00:00:00Z"),
+		_K("2021-06-00T00:00:00Z"), _K("2021-06-01T24:00:00Z"), _K("2021-06-01T13:60:00Z"), _K("2016-12-31T23:59:60Z"),
+		_K("2021-06-01T13:00:00.5Z"), _K("2021-06-01T13:00:00.000-06:00"), _K("2021-06-01T13:00:00"),
+		_K("2021-06-01T13:00:00+24:00"), _K("2021-06-01T13:00:00+05:3"), _K("2021-06-01T13:00:00Z "), _K("2021-6-01T13:00:00Z")
+	};
+	for (auto invalid : fallback)
+	{
+		kml_string value(invalid);
+		CHECK(!parseIso8601(value.c_str(), value.length(), seconds));
+	}
+	const kml_char* localFallback[] = { _K("2021-06-01 13:00:00.5"), _K("2021-02-30 13:00:00"), _K("2021-06-01T13:00:00") };
+	for (auto invalid : localFallback)
+	{
+		kml_string value(invalid);
+		CHECK(!parseDateTime(value.c_str(), value.length(), seconds));
+	}
+}
+
+//the fast path gives the same text WTime does, and falls back to WTime for anything it can't parse
+static void testTimeContext()
+{
+	ModelArena arena;
+	ModelArena::Scope scope(&arena);
+	InputDataTable table;
+	auto placemarkAt = [&table](const kml_char* time, const kml_char* timestamp) {
+		auto placemark = std::make_unique<InputPlacemark>();
+		placemark->time = time;
+		if (timestamp)
+		{
+			placemark->extendedData = new InputExtendedData();
+			placemark->extendedData->schemaData = new InputSchemaData(&table);
+			placemark->extendedData->schemaData->setValue(_K("TIMESTAMP"), timestamp);
+		}
+		return placemark;
+	};
+	auto slow = [](OutputTimeContext& context, const InputPlacemark* placemark) {
+		HSS_Time::WTime time(&context.manager);
+		CHECK(context.parse(placemark, time));
+		return context.format(time);
+	};
+
+	const HSS_Time::WTimeSpan offsets[] = { HSS_Time::WTimeSpan(-6 * 60 * 60), HSS_Time::WTimeSpan(0), HSS_Time::WTimeSpan(5 * 60 * 60 + 30 * 60) };
+	for (auto& offset : offsets)
+	{
+		//the first time of each kind calibrates the context against WTime
+		OutputTimeContext context(offset);
+		std::int64_t seconds;
+		bool hasTime;
+		auto iso = placemarkAt(_K("2021-06-01T13:00:00-06:00"), nullptr);
+		CHECK(context.parseSeconds(iso.get(), seconds, hasTime));
+		CHECK(hasTime && seconds == 1622574000);
+		CHECK(context.formatSeconds(seconds) == slow(context, iso.get()));
+		auto later = placemarkAt(_K("2021-12-31T23:59:59Z"), nullptr);
+		CHECK(context.parseSeconds(later.get(), seconds, hasTime));
+		CHECK(context.formatSeconds(seconds) == slow(context, later.get()));
+
+		//the TIMESTAMP data is a local time in the offset
+		auto local = placemarkAt(_K(""), _K("2021-06-01 13:00:00"));
+		CHECK(context.parseSeconds(local.get(), seconds, hasTime));
+		CHECK(hasTime && seconds == 1622552400 - offset.GetTotalSeconds());
+		CHECK(context.formatSeconds(seconds) == slow(context, local.get()));
+
+		auto none = placemarkAt(_K(""), nullptr);
+		CHECK(context.parseSeconds(none.get(), seconds, hasTime));
+		CHECK(!hasTime);
+
+		//fractional seconds and invalid dates fall back to WTime
+		auto fraction = placemarkAt(_K("2021-06-01T13:00:00.5-06:00"), nullptr);
+		CHECK(!context.parseSeconds(fraction.get(), seconds, hasTime));
+		CHECK(hasTime);
+		auto invalid = placemarkAt(_K("2021-02-30T13:00:00Z"), nullptr);
+		CHECK(!context.parseSeconds(invalid.get(), seconds, hasTime));
+	}
+}
+
+static std::string writeSample(bool prettyPrint)
+{
+	StringTarget target;
+	{
+		KmlWriter writer(&target, prettyPrint);
+		writer.startDocument();
+		writer.startElement(_X("kml"));
+		writer.attribute(_X("xmlns"), _K("http://www.opengis.net/kml/2.2"));
+		writer.startElement(_X("Document"));
+		writer.textElement(_X("name"), utf8_to_kml("a < b & \"c\" > d \xc3\xa9 \xf0\x9f\x94\xa5"));
+		writer.startElement(_X("Folder"));
+		writer.endElement();
+		writer.textElement(_X("name"), kml_string());
+		writer.endElement();
+		writer.endElement();
+		writer.endDocument();
+	}
+	return target.text;
+}
+
+static void testWriter()
+{
+	//the same text DOMLSSerializer wrote for the equivalent DOM
+	CHECK(writeSample(true) ==
+		"<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\" ?>\n"
+		"<kml xmlns=\"http://www.opengis.net/kml/2.2\">\n"
+		"  <Document>\n"
+		"    <name>a &lt; b &amp; \"c\" &gt; d \xc3\xa9 \xf0\x9f\x94\xa5</name>\n"
+		"    <Folder/>\n"
+		"    <name></name>\n"
+		"  </Document>\n"
+		"</kml>\n");
+	CHECK(writeSample(false) ==
+		"<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\" ?>"
+		"<kml xmlns=\"http://www.opengis.net/kml/2.2\"><Document>"
+		"<name>a &lt; b &amp; \"c\" &gt; d \xc3\xa9 \xf0\x9f\x94\xa5</name>"
+		"<Folder/><name></name></Document></kml>");
+
+	StringTarget target;
+	{
+		KmlWriter writer(&target, false);
+		writer.startElement(_X("p"));
+		writer.attribute(_X("v"), _K("\"&<"));
+		writer.endElement();
+	}
+	CHECK(target.text == "<p v=\"&quot;&amp;&lt;\"/>");
+
+	//attributes keep '>' and replace whitespace, text only replaces the carriage return
+	target.text.clear();
+	{
+		KmlWriter writer(&target, false);
+		writer.startElement(_X("p"));
+		writer.attribute(_X("v"), _K(">\r\n\t"));
+		writer.text(_K(">\r\n\t"));
+		writer.endElement();
+	}
+	CHECK(target.text == "<p v=\">&#xD;&#xA;&#x9;\">&gt;&#xD;\n\t</p>");
+
+#ifndef KML_UTF8_MODEL
+	//half of a surrogate pair has no UTF-8 encoding
+	bool threw = false;
+	try
+	{
+		KmlWriter writer(&target, false);
+		writer.textElement(_X("name"), kml_string(1, static_cast<kml_char>(0xd83d)));
+	}
+	catch (std::range_error&)
+	{
+		threw = true;
+	}
+	CHECK(threw);
+#endif
+}
+
+//the writer and DOMLSSerializer write the same bytes for the same document
+static void testWriterMatchesSerializer()
+{
+	initializeXML();
+	const xerces_string special = _X("a&b<c>d\"e'f\r\ng\th \u00e9 \U0001f525");
+	auto implementation = xercesc::DOMImplementationRegistry::getDOMImplementation(_X("LS"));
+	auto document = implementation->createDocument(nullptr, _X("kml"), nullptr);
+	auto kml = document->getDocumentElement();
+	kml->setAttribute(_X("id"), special.c_str());
+	auto name = document->createElement(_X("name"));
+	kml->appendChild(name);
+	name->setTextContent(special.c_str());
+	kml->appendChild(document->createElement(_X("Folder")));
+
+	for (bool prettyPrint : { true, false })
+	{
+		StringTarget expected;
+		auto serializer = static_cast<xercesc::DOMImplementationLS*>(implementation)->createLSSerializer();
+		serializer->getDomConfig()->setParameter(xercesc::XMLUni::fgDOMWRTFormatPrettyPrint, prettyPrint);
+		auto output = static_cast<xercesc::DOMImplementationLS*>(implementation)->createLSOutput();
+		output->setByteStream(&expected);
+		serializer->write(document, output);
+		output->release();
+		serializer->release();
+
+		StringTarget actual;
+		{
+			KmlWriter writer(&actual, prettyPrint);
+			writer.startDocument();
+			writer.startElement(_X("kml"));
+			writer.attribute(_X("id"), xerces_to_kml(special));
+			writer.textElement(_X("name"), xerces_to_kml(special));
+			writer.startElement(_X("Folder"));
+			writer.endElement();
+			writer.endElement();
+			writer.endDocument();
+		}
+		CHECK(actual.text == expected.text);
+	}
+
+	document->release();
+	deinitializeXML();
+}
+
+static void testCoordinates()
+{
+	Coordinates coordinates;
+	coordinates.value = _K("\n\t-114.123456789012345,51.00000004,1234.5   -0.5,1e2,0\n");
+	CHECK(coordinates.parse());
+	CHECK(coordinates.tuples && coordinates.tuples->longitude.size() == 2);
+	CHECK(coordinates.tuples->hasAltitude);
+	CHECK(coordinates.tuples->longitude[0] == -114.123456789012345);
+	CHECK(coordinates.tuples->latitude[0] == 51.00000004);
+	CHECK(coordinates.tuples->latitude[1] == 100);
+	coordinates.format();
+	CHECK(coordinates.value == _K("-114.12345678901235,51.00000004,1234.5 -0.5,100,0"));
+
+	//the formatted text reads back as exactly the same numbers
+	Coordinates copy(coordinates);
+	CHECK(copy.parse());
+	CHECK(copy.tuples->longitude == coordinates.tuples->longitude);
+	CHECK(copy.tuples->latitude == coordinates.tuples->latitude);
+	CHECK(copy.tuples->altitude == coordinates.tuples->altitude);
+
+	//text referenced in the input without an altitude
+	const char raw[] = "1,2 3.25,4";
+	Coordinates passthrough;
+	passthrough.raw = raw;
+	passthrough.rawLength = sizeof(raw) - 1;
+	CHECK(passthrough.tuples == nullptr);
+	CHECK(passthrough.parse());
+	CHECK(!passthrough.tuples->hasAltitude);
+	passthrough.format();
+	CHECK(passthrough.raw == nullptr);
+	CHECK(passthrough.value == _K("1,2 3.25,4"));
+
+	//CRLF and CR line ends in the input are written as the LF the parser read
+	const char lines[] = "1,2\r\n3,4\r5,6\r\n";
+	Coordinates crlf;
+	crlf.raw = lines;
+	crlf.rawLength = sizeof(lines) - 1;
+	CHECK(crlf.text() == _K("1,2\n3,4\n5,6\n"));
+	{
+		StringTarget target;
+		{
+			KmlWriter writer(&target, false);
+			crlf.write(writer);
+		}
+		CHECK(target.text == "<coordinates>1,2\n3,4\n5,6\n</coordinates>");
+	}
+
+	const kml_char* invalid[] = { _K("1,2 bad"), _K("1,2,"), _K("1"), _K("1,2,3,4"), _K("1;2") };
+	for (auto text : invalid)
+	{
+		Coordinates bad;
+		bad.value = text;
+		CHECK(!bad.parse());
+		CHECK(bad.tuples == nullptr);
+	}
+
+	//once parsed the tuples are what is written, rounded if the writer has a precision
+	Coordinates edited;
+	edited.value = _K("1,2  3.25,4");
+	CHECK(edited.parse());
+	edited.tuples->latitude[1] = 4.125;
+	CHECK(edited.text() == _K("1,2 3.25,4.125"));
+	StringTarget target;
+	{
+		KmlWriter writer(&target, false, false, 2);
+		edited.write(writer);
+	}
+	edited.tuples->longitude[0] = std::numeric_limits<double>::infinity();
+	edited.tuples->latitude[0] = std::numeric_limits<double>::quiet_NaN();
+	{
+		KmlWriter writer(&target, false);
+		edited.write(writer);
+	}
+	CHECK(target.text == "<coordinates>1,2 3.25,4.13</coordinates><coordinates>inf,nan 3.25,4.125</coordinates>");
+}
+
+//a coordinate list written from model text and from text referenced in the input, which have to agree
+static std::string writeCoordinates(const char* text, bool normalize, std::int32_t precision)
+{
+	StringTarget target;
+	{
+		KmlWriter writer(&target, false, normalize, precision);
+		writer.escapedCoordinateElement(_X("coordinates"), text, std::strlen(text));
+	}
+	StringTarget model;
+	{
+		KmlWriter writer(&model, false, normalize, precision);
+		writer.coordinateElement(_X("coordinates"), utf8_to_kml(text));
+	}
+	CHECK(target.text == model.text);
+	return target.text;
+}
+
+static void testNormalizeCoordinates()
+{
+	CHECK(writeCoordinates("\r\n\t1,2,0 \r\n  3,4,0\t\t5,6,0\r\n", true, -1) == "<coordinates>1,2,0 3,4,0 5,6,0</coordinates>");
+	CHECK(writeCoordinates(" \r\n\t ", true, -1) == "<coordinates></coordinates>");
+	CHECK(writeCoordinates("1,2\t3,4", false, -1) == "<coordinates>1,2\t3,4</coordinates>");
+	//only the whitespace is touched, even when the list isn't valid
+	CHECK(writeCoordinates(" 1.50,2  bad\n", true, -1) == "<coordinates>1.50,2 bad</coordinates>");
+}
+
+static void testCoordinatePrecision()
+{
+	CHECK(writeCoordinates("-114.123456789,51.987654321,1234.5", false, 3) == "<coordinates>-114.123,51.988,1234.5</coordinates>");
+	//halves round away from zero
+	CHECK(writeCoordinates("2.5,-2.5", false, 0) == "<coordinates>3,-3</coordinates>");
+	CHECK(writeCoordinates("0.125,-0.125", false, 2) == "<coordinates>0.13,-0.13</coordinates>");
+	//values that round to zero are written without a sign
+	CHECK(writeCoordinates("-0.0001,-0,-0.25", false, 0) == "<coordinates>0,0,0</coordinates>");
+	//the list is always written with single spaces once it is rounded
+	CHECK(writeCoordinates("\r\n1,2\t\t3,4\r\n", false, 1) == "<coordinates>1,2 3,4</coordinates>");
+
+	//more than 15 decimal places is clamped to 15
+	CHECK(writeCoordinates("0.12345678901234567,1", false, 20) == "<coordinates>0.123456789012346,1</coordinates>");
+	CHECK(writeCoordinates("0.12345678901234567,1", false, 15) == "<coordinates>0.123456789012346,1</coordinates>");
+	//past 2^53 the shortest text is used since the double has no more digits
+	CHECK(writeCoordinates("12345.678,1", false, 15) == "<coordinates>12345.678,1</coordinates>");
+
+	//anything that isn't a coordinate list is written as it is
+	const char* invalid[] = { "1,2 bad", "1,2,", "1", "1,2,3,4", "1;2", "1,2\t3" };
+	for (auto text : invalid)
+		CHECK(writeCoordinates(text, false, 3) == std::string("<coordinates>") + text + "</coordinates>");
+	CHECK(writeCoordinates(" 1,2  bad ", true, 3) == "<coordinates>1,2 bad</coordinates>");
+}
+
+//blocks deflated on several threads inflate back to the text that was written, with its checksum and length
+static void testParallelDeflate()
+{
+	std::string text;
+	for (int i = 0; text.size() < 600 * 1024; i++)
+		text += "<Placemark><name>" + std::to_string(i) + "</name><coordinates>-114." + std::to_string(i * 7919 % 100000) + ",51,0</coordinates></Placemark>\n";
+
+	for (std::size_t size : { text.size(), static_cast<std::size_t>(100), static_cast<std::size_t>(0) })
+	{
+		for (std::uint32_t threads : { 1U, 4U })
+		{
+			std::vector<std::uint8_t> compressed;
+			ParallelDeflate deflate(6, threads, [&compressed](const std::uint8_t* data, std::size_t length) {
+				compressed.insert(compressed.end(), data, data + length);
+			});
+			//uneven writes so the blocks are split part way through them
+			auto data = reinterpret_cast<const std::uint8_t*>(text.data());
+			for (std::size_t at = 0; at < size; at += 7001)
+				deflate.write(data + at, std::min<std::size_t>(7001, size - at));
+			deflate.finish();
+
+			CHECK(deflate.length() == size);
+			CHECK(deflate.crc() == crc32(crc32(0L, Z_NULL, 0), data, static_cast<uInt>(size)));
+
+			std::vector<std::uint8_t> inflated(size + 1);
+			z_stream stream = {};
+			CHECK(inflateInit2(&stream, -MAX_WBITS) == Z_OK);
+			stream.next_in = compressed.data();
+			stream.avail_in = static_cast<uInt>(compressed.size());
+			stream.next_out = inflated.data();
+			stream.avail_out = static_cast<uInt>(inflated.size());
+			CHECK(inflate(&stream, Z_FINISH) == Z_STREAM_END);
+			CHECK(stream.avail_in == 0);
+			inflated.resize(stream.total_out);
+			inflateEnd(&stream);
+			CHECK(std::string(inflated.begin(), inflated.end()) == text.substr(0, size));
+		}
+	}
+}
+
+static const char SAMPLE_KML[] =
+	"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n"
+	"<kml xmlns=\"http://www.opengis.net/kml/2.2\">\r\n"
+	"<Document id=\"root\"><name>perimeters</name>\r\n"
+	"<Schema name=\"perimeter\" id=\"perimeter\"><SimpleField name=\"TIMESTAMP\" type=\"string\"/><SimpleField name=\"AREA\" type=\"double\"/></Schema>\r\n"
+	"<Folder><name>Perimeters</name>\r\n"
+	"<Placemark><name>p &amp; 1 \xc3\xa9</name>\r\n"
+	"<Style><LineStyle><color>ff00ff00</color></LineStyle><PolyStyle><fill>0</fill></PolyStyle></Style>\r\n"
+	"<ExtendedData><SchemaData schemaUrl=\"#perimeter\"><SimpleData name=\"TIMESTAMP\">2021-06-01T13:00:00-06:00</SimpleData>"
+	"<SimpleData name=\"AREA\">12.5</SimpleData><SimpleData name=\"area\">13</SimpleData></SchemaData></ExtendedData>\r\n"
+	"<MultiGeometry><Polygon><outerBoundaryIs><LinearRing><coordinates>\r\n -114,51,0 -114.1,51,0\r\n\t-114.1,51.1,0 -114,51,0\r\n</coordinates>"
+	"</LinearRing></outerBoundaryIs></Polygon></MultiGeometry>\r\n"
+	"</Placemark>\r\n"
+	"<Placemark><name>line</name><TimeStamp><when>2021-06-01T19:00:00Z</when></TimeStamp>"
+	"<LineString><coordinates>1,2 3,4</coordinates></LineString><unknown><name>ignored</name></unknown></Placemark>\r\n"
+	"</Folder></Document></kml>\r\n";
+
+static std::string readFile(const kmlFs::path& path)
+{
+	std::ifstream stream(path, std::ios::binary);
+	std::ostringstream text;
+	text << stream.rdbuf();
+	return text.str();
+}
+
+//the model built from SAX events, with and without the coordinates referencing the input, is the one the DOM builds
+static void testSaxMatchesDom()
+{
+	initializeXML();
+	auto directory = kmlFs::temp_directory_path();
+	auto input = directory / "kmltests_input.kml";
+	{
+		std::ofstream stream(input, std::ios::binary);
+		stream << SAMPLE_KML;
+	}
+
+	const struct { bool streaming; bool passthrough; } modes[] = { { false, false }, { true, false }, { true, true } };
+	std::string saved[3];
+	for (std::size_t i = 0; i < 3; i++)
+	{
+		InputKmlFile file(input, modes[i].streaming, modes[i].passthrough);
+		CHECK(file.document != nullptr);
+		auto output = directory / ("kmltests_output" + std::to_string(i) + ".kml");
+		CHECK(file.save(output));
+		saved[i] = readFile(output);
+		kmlFs::remove(output);
+	}
+	kmlFs::remove(input);
+
+	CHECK(saved[0].find("<coordinates>") != std::string::npos);
+	CHECK(saved[1] == saved[0]);
+	CHECK(saved[2] == saved[0]);
+	deinitializeXML();
+}
+
+static std::size_t count(const std::string& text, const char* find)
+{
+	std::size_t found = 0;
+	for (auto at = text.find(find); at != std::string::npos; at = text.find(find, at + 1))
+		found++;
+	return found;
+}
+
+static void testIntern()
+{
+	ModelArena input;
+	ModelArena output(&input);
+	ModelArena other;
+	auto internIn = [](ModelArena* arena, const kml_char* text) { ModelArena::Scope scope(arena); return intern(text); };
+
+	CHECK(internIn(&input, _K("ff0000ff")) == internIn(&output, _K("ff0000ff")));
+	CHECK(internIn(&input, _K("ff0000ff")) != internIn(&other, _K("ff0000ff")));
+	CHECK(internIn(&other, _K("")) == InternedString());
+
+	bool threw = false;
+	try
+	{
+		intern(_K("ff0000ff"));
+	}
+	catch (std::logic_error&)
+	{
+		threw = true;
+	}
+	CHECK(threw);
+}
+
+static void testSharedStyles()
+{
+	ModelArena inputArena;
+	ModelArena outputArena(&inputArena);
+	InputDocument* input;
+	{
+		ModelArena::Scope scope(&inputArena);
+		input = new InputDocument();
+		auto folder = input->folder = new InputFolder(_K("Data"));
+		//the first placemark gets the default colour, the second sets the same colour from its data
+		for (int i = 0; i < 2; i++)
+		{
+			auto placemark = new InputPlacemark();
+			placemark->name = _K("p");
+			placemark->extendedData = new InputExtendedData();
+			auto data = placemark->extendedData->schemaData = new InputSchemaData(&folder->data);
+			if (i == 1)
+				data->setValue(_K("COLOR"), _K("ff0000ff"));
+			folder->placemark.push_back(placemark);
+		}
+	}
+
+	StringTarget target;
+	{
+		ModelArena::Scope scope(&outputArena);
+		OutputDocument output(input);
+		KmlWriter writer(&target);
+		output.write(writer, true);
+	}
+	CHECK(count(target.text, "<Style ") == 1);
+	CHECK(count(target.text, "<styleUrl>#style1</styleUrl>") == 2);
+}
+
+static void testSchemaData()
+{
+	ModelArena arena;
+	ModelArena::Scope scope(&arena);
+	InputDataTable table;
+	InputSchemaData first(&table);
+	first.setValue(_K("Name"), _K("a"));
+	first.setValue(_K("WIDTH"), _K("1"));
+	first.setValue(_K("TimeStamp"), _K("2021-06-01T13:00:00"));
+	first.setValue(_K("Name"), _K("b"));
+	first.setValue(_K("width"), _K("2"));
+	first.setValue(_K("TIMESTAMP"), _K("2021-06-02T13:00:00"));
+	InputSchemaData second(&table);
+	second.setValue(_K("name"), _K("c"));
+	second.setValue(_K("WIDTH"), _K("3"));
+
+	//the last width is used like it was before the values were stored in columns
+	CHECK(first.value(InputDataTable::Role::Width)->str() == _K("2"));
+	CHECK(first.value(InputDataTable::Role::Timestamp)->str() == _K("2021-06-01T13:00:00"));
+	CHECK(first.value(InputDataTable::Role::Color) == nullptr);
+	CHECK(second.value(InputDataTable::Role::Width)->str() == _K("3"));
+
+	//repeated fields are all written, in order, with the spelling they were read with
+	StringTarget target;
+	{
+		KmlWriter writer(&target, false);
+		OutputSchemaData(&first).write(writer);
+		OutputSchemaData(&second).write(writer);
+	}
+	CHECK(target.text ==
+		"<SchemaData><SimpleData name=\"Name\">a</SimpleData><SimpleData name=\"Name\">b</SimpleData></SchemaData>"
+		"<SchemaData><SimpleData name=\"name\">c</SimpleData></SchemaData>");
+}
+
+
+int main()
+{
+	std::function<void()> tests[] = {
+		testArenaAllocator,
+		testTagLookup,
+		testTranscoders,
+		testTimes,
+		testTimeContext,
+		testWriter,
+		testWriterMatchesSerializer,
+		testCoordinates,
+		testNormalizeCoordinates,
+		testCoordinatePrecision,
+		testIntern,
+		testParallelDeflate,
+		testSharedStyles,
+		testSchemaData,
+		testSaxMatchesDom,
+	};
+	for (auto& test : tests)
+	{
+		try
+		{
+			test();
+		}
+		catch (std::exception& e)
+		{
+			std::printf("unexpected exception: %s\n", e.what());
+			s_failures++;
+		}
+	}
+
+	if (s_failures)
+		std::printf("%d checks failed\n", s_failures);
+	return s_failures ? 1 : 0;
+}